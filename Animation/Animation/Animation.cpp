@@ -89,7 +89,7 @@ public:
 			0, 0, -2 * fp*bp / (bp - fp), 0);
 	}
 	void SetUniform() {
-		int location = glGetUniformLocation(gpuProgram->getId(), "wEye");
+		int location = getUniformLocation(gpuProgram->getId(), "wEye");
 		if (location >= 0) glUniform3fv(location, 1, &wEye.x);
 		else printf("uniform wEye cannot be set\n");
 	}
@@ -107,7 +107,7 @@ struct Material {
 		kd.SetUniform(gpuProgram->getId(), "kd");
 		ks.SetUniform(gpuProgram->getId(), "ks");
 		ka.SetUniform(gpuProgram->getId(), "ka");
-		int location = glGetUniformLocation(gpuProgram->getId(), "shine");
+		int location = getUniformLocation(gpuProgram->getId(), "shine");
 		if (location >= 0) glUniform1f(location, shininess); else printf("uniform shininess cannot be set\n");
 	}
 };
@@ -150,15 +150,16 @@ public:
 	Geometry(unsigned int _type) {
 		type = _type;
 		glGenVertexArrays(1, &vao);
-		glBindVertexArray(vao);
+		bindVertexArray(vao);
 	}
-	void Draw(mat4 M, mat4 Minv) {
+	void Draw(const Affine& model) {
+		mat4 M = model, Minv = model.normalMatrix();
 		mat4 MVP = M * camera.V() * camera.P();
 		MVP.SetUniform(gpuProgram->getId(), "MVP");
 		M.SetUniform(gpuProgram->getId(), "M");
 		Minv.SetUniform(gpuProgram->getId(), "Minv");
-		glBindVertexArray(vao);
-		glDrawArrays(type, 0, nVertices);
+		bindVertexArray(vao);
+		drawArrays(type, 0, nVertices);
 	}
 };
 
@@ -171,9 +172,10 @@ public:
 	virtual VertexData GenVertexData(float u, float v) = 0;
 
 	void Create(int N = 16, int M = 16) {
+		TRACE_SCOPE("ParamSurface::Create");
 		unsigned int vbo;
 		glGenBuffers(1, &vbo); // Generate 1 vertex buffer object
-		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		bindBuffer(GL_ARRAY_BUFFER, vbo);
 		nVertices = N * M * 6;
 		std::vector<VertexData> vtxData;	// vertices on the CPU
 		for (int i = 0; i < N; i++) {
@@ -269,9 +271,9 @@ public:
 		material = _m;
 		quad = new Quad();
 	}
-	void Draw(mat4 M, mat4 Minv) {
+	void Draw(const Affine& M) {
 		material->SetUniform();
-		quad->Draw(M, Minv);
+		quad->Draw(M);
 	}
 };
 
@@ -280,24 +282,13 @@ const float legLength = 5;
 
 #define INVERSE_KINEMATICS
 //===============================================================
-class PrimitiveMan {
+struct ManPose {	// the moving part of PrimitiveMan
 	//===============================================================
-	Material * material;
-	Sphere * head;
-	TruncatedCone * torso;
-	Sphere * joint;
-	TruncatedCone * bone;
-
 	float dleftarm_angle, drightarm_angle, dleftleg_angle, drightleg_angle;
 	float leftLegAngle, rightLegAngle, leftArmAngle, rightArmAngle, leftToeAngle, rightToeAngle;
 	float forward, up;          // movement
-public:
-	PrimitiveMan(Material * _m) {
-		material = _m;
-		head = new Sphere(1.5);
-		torso = new TruncatedCone(1.0, 0.8);
-		joint = new Sphere(boneRadius);
-		bone = new TruncatedCone(boneRadius, boneRadius / 5);
+
+	ManPose() {
 		forward = 0;
 		up = legLength + boneRadius;
 
@@ -311,7 +302,7 @@ public:
 		rightArmAngle = 30;
 		leftArmAngle = 150;
 	}
-	float Forward() { return forward; }
+	float Forward() const { return forward; }
 
 	void Animate(float dt) {
 		if (forward < 105) {
@@ -339,87 +330,117 @@ public:
 			up -= 2 * dt;
 		}
 	}
-	void DrawHead(mat4 M, mat4 Minv) {
-		M = TranslateMatrix(vec3(0, 6.5f, 0)) * M;
-		Minv = Minv * TranslateMatrix(-vec3(0, 6.5f, 0));
-		head->Draw(M, Minv);
+
+	static ManPose Interpolate(const ManPose& p0, const ManPose& p1, float alpha) {
+		ManPose pose = p1;		// the velocities of the newer pose
+		pose.leftLegAngle = p0.leftLegAngle + (p1.leftLegAngle - p0.leftLegAngle) * alpha;
+		pose.rightLegAngle = p0.rightLegAngle + (p1.rightLegAngle - p0.rightLegAngle) * alpha;
+		pose.leftArmAngle = p0.leftArmAngle + (p1.leftArmAngle - p0.leftArmAngle) * alpha;
+		pose.rightArmAngle = p0.rightArmAngle + (p1.rightArmAngle - p0.rightArmAngle) * alpha;
+		pose.leftToeAngle = p0.leftToeAngle + (p1.leftToeAngle - p0.leftToeAngle) * alpha;
+		pose.rightToeAngle = p0.rightToeAngle + (p1.rightToeAngle - p0.rightToeAngle) * alpha;
+		pose.forward = p0.forward + (p1.forward - p0.forward) * alpha;
+		pose.up = p0.up + (p1.up - p0.up) * alpha;
+		return pose;
 	}
-	void DrawTorso(mat4 M, mat4 Minv) {
-		M = ScaleMatrix(vec3(2, 1, 5)) * RotationMatrix(90 * M_PI / 180, vec3(1, 0, 0)) * TranslateMatrix(vec3(0, 5, 0)) * M;
-		Minv = Minv * TranslateMatrix(-vec3(0, 5, 0)) * RotationMatrix(-90 * M_PI / 180, vec3(1, 0, 0)) * ScaleMatrix(vec3(0.5, 1, 0.2));
-		torso->Draw(M, Minv);
+};
+
+//===============================================================
+class PrimitiveMan : public ManPose {	// drawn in the pose it inherits
+	//===============================================================
+	Material * material;
+	Sphere * head;
+	TruncatedCone * torso;
+	Sphere * joint;
+	TruncatedCone * bone;
+public:
+	PrimitiveMan(Material * _m) {
+		material = _m;
+		head = new Sphere(1.5);
+		torso = new TruncatedCone(1.0, 0.8);
+		joint = new Sphere(boneRadius);
+		bone = new TruncatedCone(boneRadius, boneRadius / 5);
+	}
+	void SetPose(const ManPose& pose) { (ManPose&)*this = pose; }
+
+	void DrawHead(Affine M) {
+		M = TranslateAffine(vec3(0, 6.5f, 0)) * M;
+		head->Draw(M);
+	}
+	void DrawTorso(Affine M) {
+		M = ScaleAffine(vec3(2, 1, 5)) * RotationAffine(90 * M_PI / 180, vec3(1, 0, 0)) * TranslateAffine(vec3(0, 5, 0)) * M;
+		torso->Draw(M);
 	}
-	void DrawLeftLeg(mat4 M, mat4 Minv) {
-		joint->Draw(M, Minv);
+	void DrawLeftLeg(Affine M) {
+		joint->Draw(M);
 
-		M = RotationMatrix(leftLegAngle * M_PI / 180, vec3(1, 0, 0)) * M;
-		Minv = Minv * RotationMatrix(-leftLegAngle * M_PI / 180, vec3(1, 0, 0));
-		bone->Draw(ScaleMatrix(vec3(1, 1, legLength)) * TranslateMatrix(vec3(0, 0, boneRadius)) * M,
-			Minv * TranslateMatrix(-vec3(0, 0, boneRadius)) * ScaleMatrix(vec3(1, 1, 1 / legLength)));
+		M = RotationAffine(leftLegAngle * M_PI / 180, vec3(1, 0, 0)) * M;
+		bone->Draw(ScaleAffine(vec3(1, 1, legLength)) * TranslateAffine(vec3(0, 0, boneRadius)) * M);
 
-		DrawToe(RotationMatrix(-leftLegAngle * M_PI / 180, vec3(1, 0, 0)) * TranslateMatrix(vec3(0, 0, legLength)) * M,
-			Minv * TranslateMatrix(-vec3(0, 0, legLength)) * RotationMatrix(leftLegAngle * M_PI / 180, vec3(1, 0, 0)));
+		DrawToe(RotationAffine(-leftLegAngle * M_PI / 180, vec3(1, 0, 0)) * TranslateAffine(vec3(0, 0, legLength)) * M);
 	}
 
-	void DrawRightLeg(mat4 M, mat4 Minv) {
-		joint->Draw(M, Minv);
+	void DrawRightLeg(Affine M) {
+		joint->Draw(M);
 
-		M = RotationMatrix(rightLegAngle * M_PI / 180, vec3(1, 0, 0)) * M;
-		Minv = Minv * RotationMatrix(-rightLegAngle * M_PI / 180, vec3(1, 0, 0));
+		M = RotationAffine(rightLegAngle * M_PI / 180, vec3(1, 0, 0)) * M;
 		const float legLength = 5;
-		bone->Draw(ScaleMatrix(vec3(1, 1, legLength)) * TranslateMatrix(vec3(0, 0, boneRadius)) * M,
-			Minv * TranslateMatrix(-vec3(0, 0, boneRadius)) * ScaleMatrix(vec3(1, 1, 1 / legLength)));
+		bone->Draw(ScaleAffine(vec3(1, 1, legLength)) * TranslateAffine(vec3(0, 0, boneRadius)) * M);
 
-		DrawToe(RotationMatrix(-rightLegAngle * M_PI / 180, vec3(1, 0, 0)) * TranslateMatrix(vec3(0, 0, legLength)) *M,
-			Minv  * TranslateMatrix(-vec3(0, 0, legLength))* RotationMatrix(rightLegAngle * M_PI / 180, vec3(1, 0, 0)));
+		DrawToe(RotationAffine(-rightLegAngle * M_PI / 180, vec3(1, 0, 0)) * TranslateAffine(vec3(0, 0, legLength)) * M);
 	}
 
-	void DrawToe(mat4 M, mat4 Minv) {
-		joint->Draw(M, Minv);
+	void DrawToe(Affine M) {
+		joint->Draw(M);
 		const float toeLength = 1;
-		bone->Draw(ScaleMatrix(vec3(1, 1, toeLength)) * TranslateMatrix(vec3(0, 0, boneRadius)) * M,
-			Minv * TranslateMatrix(-vec3(0, 0, boneRadius)) * ScaleMatrix(vec3(1, 1, 1 / toeLength)));
+		bone->Draw(ScaleAffine(vec3(1, 1, toeLength)) * TranslateAffine(vec3(0, 0, boneRadius)) * M);
 	}
 
-	void DrawArm(mat4 M, mat4 Minv) {
-		joint->Draw(M, Minv);
-		const float toeLength = 1;
-		bone->Draw(ScaleMatrix(vec3(1, 1, 4)) * TranslateMatrix(vec3(0, 0, boneRadius)) * M,
-			Minv * TranslateMatrix(-vec3(0, 0, boneRadius)) * ScaleMatrix(vec3(1, 1, 1.0 / 4)));
+	void DrawArm(Affine M) {
+		joint->Draw(M);
+		bone->Draw(ScaleAffine(vec3(1, 1, 4)) * TranslateAffine(vec3(0, 0, boneRadius)) * M);
 	}
 
-	void Draw(mat4 M, mat4 Minv) {     // Draw the hierarchy
-		M = TranslateMatrix(vec3(0, up, forward)) * M;
-		Minv = Minv * TranslateMatrix(-vec3(0, up, forward));
+	void Draw(Affine M) {     // Draw the hierarchy
+		M = TranslateAffine(vec3(0, up, forward)) * M;
 		material->SetUniform();
-		DrawHead(M, Minv);
-		DrawTorso(M, Minv);
+		DrawHead(M);
+		DrawTorso(M);
 
 		vec3 rightLegJoint(-2, 0, 0);
-		DrawRightLeg(TranslateMatrix(rightLegJoint) * M, Minv * TranslateMatrix(-rightLegJoint));
+		DrawRightLeg(TranslateAffine(rightLegJoint) * M);
 
 		vec3 leftLegJoint(2, 0, 0);
-		DrawLeftLeg(TranslateMatrix(leftLegJoint) * M, Minv * TranslateMatrix(-leftLegJoint));
+		DrawLeftLeg(TranslateAffine(leftLegJoint) * M);
 
 		vec3 rightArmJoint(-2.4, 5, 0);
-		DrawArm(RotationMatrix(rightArmAngle * M_PI / 180, vec3(1, 0, 0)) * TranslateMatrix(rightArmJoint) * M,
-			Minv * TranslateMatrix(-rightArmJoint) * RotationMatrix(-rightArmAngle * M_PI / 180, vec3(1, 0, 0)));
+		DrawArm(RotationAffine(rightArmAngle * M_PI / 180, vec3(1, 0, 0)) * TranslateAffine(rightArmJoint) * M);
 
 		vec3 leftArmJoint(2.4, 5, 0);
-		DrawArm(RotationMatrix(leftArmAngle * M_PI / 180, vec3(1, 0, 0)) * TranslateMatrix(leftArmJoint) * M,
-			Minv * TranslateMatrix(-leftArmJoint) * RotationMatrix(-leftArmAngle * M_PI / 180, vec3(1, 0, 0)));
+		DrawArm(RotationAffine(leftArmAngle * M_PI / 180, vec3(1, 0, 0)) * TranslateAffine(leftArmJoint) * M);
 	}
 };
 
+const float simulationStep = 0.01f;				// sec
+const float animationUnitsPerSec = 1000 / 30.0f;	// the man's speeds are given per 30 msec
+
+// The animated part of the scene, copied for the simulation thread
+struct SceneState {
+	ManPose man;
+	float camAngle = 0;
+};
+
 //---------------------------
 class Scene {
 	//---------------------------
 	PrimitiveMan * pman;
 	Floor * floor;
+	FixedStepSimulation<SceneState> simulation;
 public:
 	Light light;
 
 	void Build() {
+		TRACE_SCOPE("Scene::Build");
 		// Materials
 		Material * material0 = new Material;
 		material0->kd = vec3(0.2f, 0.3f, 1);
@@ -445,39 +466,48 @@ public:
 		// Light
 		light.wLightDir = vec3(5, 5, 4);
 
+		// Animation
+		simulation.Start(SceneState(), simulationStep, Animate, Interpolate);
 	}
 	void Render() {
+		TRACE_SCOPE("Scene::Render");
+		SceneState state = simulation.Get();
+		pman->SetPose(state.man);
+
+		const float camera_rad = 30;
+		camera.wEye = vec3(cos(state.camAngle) * camera_rad, 10, sin(state.camAngle) * camera_rad + pman->Forward());
+		camera.wLookat = vec3(0, 0, pman->Forward());
 		camera.SetUniform();
 		light.SetUniform(true);
 
-		mat4 unit = TranslateMatrix(vec3(0, 0, 0));
-		floor->Draw(unit, unit);
+		Affine unit;
+		floor->Draw(unit);
 
-		pman->Draw(unit, unit);
+		pman->Draw(unit);
 		// shadow matrix that projects the man onto the floor
 
 		light.SetUniform(false);
 
-		mat4 shadowMatrix = { 1, 0, 0, 0,
-			-light.wLightDir.x / light.wLightDir.y, 0, -light.wLightDir.z / light.wLightDir.y, 0,
-			0, 0, 1, 0,
-			0, 0.001f, 0, 1 };
-		pman->Draw(shadowMatrix, shadowMatrix);
+		Affine shadowMatrix(vec3(1, 0, 0),
+			vec3(-light.wLightDir.x / light.wLightDir.y, 0, -light.wLightDir.z / light.wLightDir.y),
+			vec3(0, 0, 1),
+			vec3(0, 0.001f, 0));
+		pman->Draw(shadowMatrix);
 	}
 
-	void Animate(float t) {
-		static float tprev = 0;
-		float dt = t - tprev;
-		tprev = t;
-
-		pman->Animate(dt);
+	static void Animate(SceneState& state, float dt) {
+		TRACE_SCOPE("Scene::Animate");
+		dt *= animationUnitsPerSec;
 
-		static float cam_angle = 0;
-		cam_angle += 0.01 * dt;			// camera rotate
+		state.man.Animate(dt);
+		state.camAngle += 0.01 * dt;	// camera rotate
+	}
 
-		const float camera_rad = 30;
-		camera.wEye = vec3(cos(cam_angle) * camera_rad, 10, sin(cam_angle) * camera_rad + pman->Forward());
-		camera.wLookat = vec3(0, 0, pman->Forward());
+	static SceneState Interpolate(const SceneState& previous, const SceneState& current, float alpha) {
+		SceneState state;
+		state.man = ManPose::Interpolate(previous.man, current.man, alpha);
+		state.camAngle = previous.camAngle + (current.camAngle - previous.camAngle) * alpha;
+		return state;
 	}
 };
 
@@ -486,8 +516,8 @@ Scene scene;
 // Initialization, create an OpenGL context
 void onInitialization() {
 	glViewport(0, 0, windowWidth, windowHeight);
-	glEnable(GL_DEPTH_TEST);
-	glDisable(GL_CULL_FACE);
+	setEnabled(GL_DEPTH_TEST, true);
+	setEnabled(GL_CULL_FACE, false);
 
 	gpuProgram = new PhongShader();
 	scene.Build();
@@ -514,10 +544,7 @@ void onMouse(int button, int state, int pX, int pY) { }
 void onMouseMotion(int pX, int pY) {
 }
 
-// Idle event indicating that some time elapsed: do animation here
+// Idle event indicating that some time elapsed: the scene animates on the simulation thread
 void onIdle() {
-	long time = glutGet(GLUT_ELAPSED_TIME); // elapsed time since the start of the program
-	float sec = time / 30.0f;				// convert msec to sec
-	scene.Animate(sec);					// animate the camera
 	glutPostRedisplay();					// redraw the scene
 }
\ No newline at end of file
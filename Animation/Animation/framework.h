@@ -7,8 +7,29 @@
 #include <stdlib.h>
 #include <math.h>
 #include <vector>
-
-#if defined(__APPLE__)
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+
+#if defined(FRAMEWORK_HEADLESS)	// offscreen EGL context instead of a GLUT window, see main in framework.cpp
+#define GL_GLEXT_PROTOTYPES
+#include <GL/gl.h>
+#include <GL/glext.h>
+// the part of GLUT the programs call
+#define GLUT_ELAPSED_TIME	0x02BC
+#define GLUT_LEFT_BUTTON	0
+#define GLUT_MIDDLE_BUTTON	1
+#define GLUT_RIGHT_BUTTON	2
+#define GLUT_DOWN			0
+#define GLUT_UP				1
+int glutGet(GLenum state);
+void glutPostRedisplay();
+void glutSwapBuffers();
+int glutCreateMenu(void (*callback)(int));
+void glutAddMenuEntry(const char * label, int value);
+void glutAttachMenu(int button);
+#elif defined(__APPLE__)
 #include <GLUT/GLUT.h>
 #include <OpenGL/gl3.h>
 #else
@@ -19,9 +40,68 @@
 #include <GL/freeglut.h>	// must be downloaded unless you have an Apple
 #endif
 
+// vec4 and mat4 arithmetic on SSE registers where the target has them (AVX and FMA are used when enabled),
+// scalar code elsewhere; "-benchmark" prints the cost of the operators
+#if defined(__SSE__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 1)
+#define FRAMEWORK_SSE
+#include <immintrin.h>
+#if defined(_M_X64) || defined(__x86_64__)
+#define SIMD_ALIGN alignas(16)		// 32 bit MSVC cannot pass aligned types by value
+#endif
+#endif
+#if !defined(SIMD_ALIGN)
+#define SIMD_ALIGN
+#endif
+
 // Resolution of screen
 const unsigned int windowWidth = 600, windowHeight = 600;
 
+// Command line options of the program itself, available from onInitialization on
+bool hasCommandLineOption(const char * option);
+
+// Location of a uniform variable, looked up in the table built by GPUProgram after linking (-1 if not active)
+int getUniformLocation(unsigned shaderProg, const char * name);
+// Reflect all active uniforms of a linked program into its name -> location table
+void registerUniforms(unsigned shaderProg);
+void unregisterUniforms(unsigned shaderProg);
+
+// Disk cache of linked program binaries in framework.cpp, keyed by the sources and the driver ("-noshadercache" turns it off).
+// loadCachedProgram returns 0 on a miss; the program compiled after the miss is saved by storeCachedProgram.
+unsigned loadCachedProgram(const char * vertexSource, const char * fragmentSource, const char * fragmentShaderOutputName);
+void prepareCachedProgram(unsigned shaderProg);	// before linking
+void storeCachedProgram(unsigned shaderProg);	// after linking
+
+// Frame profiler in framework.cpp: GPU time of the frames from timer queries and CPU time of onIdle, onDisplay and
+// the buffer swap. Statistics of the recent frames are printed every few seconds, "-profile file.csv" traces every frame.
+void swapBuffersProfiled();
+#define glutSwapBuffers() swapBuffersProfiled()
+
+// GL state cache in framework.cpp: calls that would not change the state are skipped, and the profiler counts draw calls,
+// state changes and skipped calls per frame. State set with the raw gl calls instead is not seen by the cache, and objects
+// must be deleted through the delete functions, as a later object may get the name of a deleted one.
+void useProgram(unsigned int program);
+void deleteProgram(unsigned int program);
+void bindVertexArray(unsigned int vertexArray);
+void deleteVertexArrays(int n, const unsigned int vertexArrays[]);
+void bindBuffer(GLenum target, unsigned int buffer);	// only GL_ARRAY_BUFFER is cached, the rest is VAO or indexed state
+void deleteBuffers(int n, const unsigned int buffers[]);
+void activeTexture(GLenum unit);						// GL_TEXTURE0 + i
+void bindTexture(GLenum target, unsigned int texture);	// to the active unit
+void deleteTextures(int n, const unsigned int textures[]);
+void bindFramebuffer(GLenum target, unsigned int framebuffer);
+void deleteFramebuffers(int n, const unsigned int framebuffers[]);
+void setEnabled(GLenum capability, bool enabled);
+void drawArrays(GLenum mode, int first, int count);
+void drawElements(GLenum mode, int count, GLenum type, const void * indices);
+
+struct vec4;
+// Fill the bound GL_TEXTURE_2D from a float image converted on the CPU to internalFormat: GL_RGBA32F, GL_RGBA16F,
+// GL_RGBA8, GL_SRGB8_ALPHA8 or GL_R8 (luminance from x, replicated to rgb). Immutable storage where the driver has it.
+void uploadTexture(int width, int height, const std::vector<vec4>& image, unsigned int internalFormat, bool mipmaps);
+
+// Event tracing: "-trace file.json" records TRACE_SCOPE("name") blocks and writes them at exit and on F12
+#include "trace.h"
+
 //--------------------------
 struct vec2 {
 //--------------------------
@@ -43,8 +123,8 @@ struct vec2 {
 		return vec2(-x, -y);
 	}
 
-	void SetUniform(unsigned shaderProg, char * name) {
-		int location = glGetUniformLocation(shaderProg, name);
+	void SetUniform(unsigned shaderProg, const char * name) {
+		int location = getUniformLocation(shaderProg, name);
 		if (location >= 0) glUniform2fv(location, 1, &x);
 		else printf("uniform %s cannot be set\n", name);
 	}
@@ -81,8 +161,8 @@ struct vec3 {
 		return vec3(-x, -y, -z);
 	}
 
-	void SetUniform(unsigned shaderProg, char * name) {
-		int location = glGetUniformLocation(shaderProg, name);
+	void SetUniform(unsigned shaderProg, const char * name) {
+		int location = getUniformLocation(shaderProg, name);
 		if (location >= 0) glUniform3fv(location, 1, &x);
 		else printf("uniform %s cannot be set\n", name);
 	}
@@ -100,8 +180,26 @@ inline vec3 cross(const vec3& v1, const vec3& v2) {
 	return vec3(v1.y * v2.z - v1.z * v2.y, v1.z * v2.x - v1.x * v2.z, v1.x * v2.y - v1.y * v2.x);
 }
 
+#if defined(FRAMEWORK_SSE)
+inline __m128 multiplyAdd(__m128 a, __m128 b, __m128 c) {	// a * b + c
+#if defined(__FMA__)
+	return _mm_fmadd_ps(a, b, c);
+#else
+	return _mm_add_ps(_mm_mul_ps(a, b), c);
+#endif
+}
+
+// v[0] * rows[0] + v[1] * rows[1] + v[2] * rows[2] + v[3] * rows[3]
+inline __m128 combineRows(const float * v, const float (*rows)[4]) {
+	__m128 r = _mm_mul_ps(_mm_set1_ps(v[0]), _mm_loadu_ps(rows[0]));
+	r = multiplyAdd(_mm_set1_ps(v[1]), _mm_loadu_ps(rows[1]), r);
+	r = multiplyAdd(_mm_set1_ps(v[2]), _mm_loadu_ps(rows[2]), r);
+	return multiplyAdd(_mm_set1_ps(v[3]), _mm_loadu_ps(rows[3]), r);
+}
+#endif
+
 //---------------------------
-struct mat4 { // row-major matrix 4x4
+struct SIMD_ALIGN mat4 { // row-major matrix 4x4
 //---------------------------
 	float m[4][4];
 public:
@@ -118,17 +216,39 @@ public:
 
 	mat4 operator*(const mat4& right) const {
 		mat4 result;
+#if defined(FRAMEWORK_SSE) && defined(__AVX__)
+		// two rows of the result in one register
+		__m256 r0 = _mm256_broadcast_ps((const __m128 *)right.m[0]), r1 = _mm256_broadcast_ps((const __m128 *)right.m[1]);
+		__m256 r2 = _mm256_broadcast_ps((const __m128 *)right.m[2]), r3 = _mm256_broadcast_ps((const __m128 *)right.m[3]);
+		for (int i = 0; i < 4; i += 2) {
+			const float * a = m[i], * b = m[i + 1];
+			__m256 row = _mm256_mul_ps(_mm256_setr_ps(a[0], a[0], a[0], a[0], b[0], b[0], b[0], b[0]), r0);
+#if defined(__FMA__)
+			row = _mm256_fmadd_ps(_mm256_setr_ps(a[1], a[1], a[1], a[1], b[1], b[1], b[1], b[1]), r1, row);
+			row = _mm256_fmadd_ps(_mm256_setr_ps(a[2], a[2], a[2], a[2], b[2], b[2], b[2], b[2]), r2, row);
+			row = _mm256_fmadd_ps(_mm256_setr_ps(a[3], a[3], a[3], a[3], b[3], b[3], b[3], b[3]), r3, row);
+#else
+			row = _mm256_add_ps(_mm256_mul_ps(_mm256_setr_ps(a[1], a[1], a[1], a[1], b[1], b[1], b[1], b[1]), r1), row);
+			row = _mm256_add_ps(_mm256_mul_ps(_mm256_setr_ps(a[2], a[2], a[2], a[2], b[2], b[2], b[2], b[2]), r2), row);
+			row = _mm256_add_ps(_mm256_mul_ps(_mm256_setr_ps(a[3], a[3], a[3], a[3], b[3], b[3], b[3], b[3]), r3), row);
+#endif
+			_mm256_storeu_ps(result.m[i], row);
+		}
+#elif defined(FRAMEWORK_SSE)
+		for (int i = 0; i < 4; i++) _mm_storeu_ps(result.m[i], combineRows(m[i], right.m));
+#else
 		for (int i = 0; i < 4; i++) {
 			for (int j = 0; j < 4; j++) {
 				result.m[i][j] = 0;
 				for (int k = 0; k < 4; k++) result.m[i][j] += m[i][k] * right.m[k][j];
 			}
 		}
+#endif
 		return result;
 	}
 
-	void SetUniform(unsigned shaderProg, char * name) {
-		int location = glGetUniformLocation(shaderProg, name);
+	void SetUniform(unsigned shaderProg, const char * name) {
+		int location = getUniformLocation(shaderProg, name);
 		if (location >= 0) glUniformMatrix4fv(location, 1, GL_TRUE, &m[0][0]);
 		else printf("uniform %s cannot be set\n", name);
 	}
@@ -157,13 +277,93 @@ inline mat4 RotationMatrix(float angle, vec3 w) {
 		        0, 0, 0, 1);
 }
 
+//---------------------------
+struct Affine { // affine transformation of row vectors p * L + t, the first three columns of a mat4
+//---------------------------
+	vec3 rows[3];	// linear part L
+	vec3 t;			// translation
+public:
+	Affine(vec3 r0 = vec3(1, 0, 0), vec3 r1 = vec3(0, 1, 0), vec3 r2 = vec3(0, 0, 1), vec3 t0 = vec3(0, 0, 0)) {
+		rows[0] = r0; rows[1] = r1; rows[2] = r2; t = t0;
+	}
+
+	vec3 transformVector(const vec3& v) const { return rows[0] * v.x + rows[1] * v.y + rows[2] * v.z; }
+	vec3 transformPoint(const vec3& p) const { return transformVector(p) + t; }
+
+	Affine operator*(const Affine& right) const {	// this first, then right, as with mat4
+		return Affine(right.transformVector(rows[0]), right.transformVector(rows[1]), right.transformVector(rows[2]),
+			          right.transformPoint(t));
+	}
+
+	// columns of the cofactor matrix: L^-1 = (c0, c1, c2) / det
+	float cofactors(vec3& c0, vec3& c1, vec3& c2) const {
+		c0 = cross(rows[1], rows[2]); c1 = cross(rows[2], rows[0]); c2 = cross(rows[0], rows[1]);
+		return dot(rows[0], c0);	// determinant
+	}
+
+	Affine inverse() const {	// L must not be singular
+		vec3 c0, c1, c2;
+		float s = 1 / cofactors(c0, c1, c2);
+		Affine inv(vec3(c0.x, c1.x, c2.x) * s, vec3(c0.y, c1.y, c2.y) * s, vec3(c0.z, c1.z, c2.z) * s);
+		inv.t = -inv.transformVector(t);
+		return inv;
+	}
+
+	// The Minv uniform of the shaders, which transform normals as Minv * n, i.e. with the inverse transpose.
+	// L^-1 up to a positive factor, so it also exists for singular transformations like projections onto a plane.
+	mat4 normalMatrix() const {
+		vec3 c0, c1, c2;
+		float s = (cofactors(c0, c1, c2) < 0) ? -1.0f : 1.0f;
+		c0 = c0 * s; c1 = c1 * s; c2 = c2 * s;
+		return mat4(c0.x, c1.x, c2.x, 0,
+			        c0.y, c1.y, c2.y, 0,
+			        c0.z, c1.z, c2.z, 0,
+			        0,    0,    0,    1);
+	}
+
+	operator mat4() const {		// at upload time
+		return mat4(rows[0].x, rows[0].y, rows[0].z, 0,
+			        rows[1].x, rows[1].y, rows[1].z, 0,
+			        rows[2].x, rows[2].y, rows[2].z, 0,
+			        t.x,       t.y,       t.z,       1);
+	}
+};
+
+inline Affine TranslateAffine(vec3 t) { return Affine(vec3(1, 0, 0), vec3(0, 1, 0), vec3(0, 0, 1), t); }
+
+inline Affine ScaleAffine(vec3 s) { return Affine(vec3(s.x, 0, 0), vec3(0, s.y, 0), vec3(0, 0, s.z)); }
+
+inline Affine RotationAffine(float angle, vec3 w) {
+	float c = cosf(angle), s = sinf(angle);
+	w = normalize(w);
+	return Affine(vec3(c * (1 - w.x*w.x) + w.x*w.x, w.x*w.y*(1 - c) + w.z*s, w.x*w.z*(1 - c) - w.y*s),
+		          vec3(w.x*w.y*(1 - c) - w.z*s, c * (1 - w.y*w.y) + w.y*w.y, w.y*w.z*(1 - c) + w.x*s),
+		          vec3(w.x*w.z*(1 - c) + w.y*s, w.y*w.z*(1 - c) - w.x*s, c * (1 - w.z*w.z) + w.z*w.z));
+}
+
 //--------------------------
-struct vec4 {
+struct SIMD_ALIGN vec4 {
 //--------------------------
 	float x, y, z, w;
 	vec4(float x0 = 0, float y0 = 0, float z0 = 0, float w0 = 0) {
 		x = x0; y = y0; z = z0; w = w0; // vector:0, point: 1, plane: d, RGBA: opacity
 	}
+#if defined(FRAMEWORK_SSE)
+	vec4(__m128 v) { _mm_storeu_ps(&x, v); }
+	__m128 load() const { return _mm_loadu_ps(&x); }
+
+	vec4 operator*(float a) const { return _mm_mul_ps(load(), _mm_set1_ps(a)); }
+
+	vec4 operator/(float d) const { return _mm_div_ps(load(), _mm_set1_ps(d)); }
+
+	vec4 operator+(const vec4& v) const { return _mm_add_ps(load(), v.load()); }
+	vec4 operator-(const vec4& v) const { return _mm_sub_ps(load(), v.load()); }
+	vec4 operator*(const vec4& v) const { return _mm_mul_ps(load(), v.load()); }
+
+	void operator+=(const vec4 right) { _mm_storeu_ps(&x, _mm_add_ps(load(), right.load())); }
+
+	vec4 operator*(const mat4& mat) const { return combineRows(&x, mat.m); }
+#else
 	vec4 operator*(float a) const { return vec4(x * a, y * a, z * a, w * a); }
 
 	vec4 operator/(float d) const { return vec4(x / d, y / d, z / d, w / d); }
@@ -179,18 +379,19 @@ struct vec4 {
 	}
 
 	void operator+=(const vec4 right) {
-		x += right.x; y += right.y; z += right.z, w += right.z;
+		x += right.x; y += right.y; z += right.z; w += right.w;
 	}
 
-	vec4 operator*(const mat4& mat) {
+	vec4 operator*(const mat4& mat) const {
 		return vec4(x * mat.m[0][0] + y * mat.m[1][0] + z * mat.m[2][0] + w * mat.m[3][0],
 			x * mat.m[0][1] + y * mat.m[1][1] + z * mat.m[2][1] + w * mat.m[3][1],
 			x * mat.m[0][2] + y * mat.m[1][2] + z * mat.m[2][2] + w * mat.m[3][2],
 			x * mat.m[0][3] + y * mat.m[1][3] + z * mat.m[2][3] + w * mat.m[3][3]);
 	}
+#endif
 
-	void SetUniform(unsigned shaderProg, char * name) {
-		int location = glGetUniformLocation(shaderProg, name);
+	void SetUniform(unsigned shaderProg, const char * name) {
+		int location = getUniformLocation(shaderProg, name);
 		if (location >= 0) glUniform4fv(location, 1, &x);
 		else printf("uniform %s cannot be set\n", name);
 	}
@@ -207,24 +408,29 @@ struct Texture {
 
 	Texture() {
 		glGenTextures(1, &textureId);  				// id generation
-		glBindTexture(GL_TEXTURE_2D, textureId);    // binding
+		bindTexture(GL_TEXTURE_2D, textureId);    // binding
 	}
 
-	Texture(int width, int height, const std::vector<vec4>& image) {
+	Texture(int width, int height, const std::vector<vec4>& image, unsigned int internalFormat = GL_RGBA8, bool mipmaps = false) {
 		glGenTextures(1, &textureId);  				// id generation
-		glBindTexture(GL_TEXTURE_2D, textureId);    // binding
+		bindTexture(GL_TEXTURE_2D, textureId);    // binding
+		Upload(width, height, image, internalFormat, mipmaps);
+	}
 
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_FLOAT, &image[0]); // To GPU
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR); // sampling
+	// once per texture, the storage is immutable
+	void Upload(int width, int height, const std::vector<vec4>& image, unsigned int internalFormat = GL_RGBA8, bool mipmaps = false) {
+		bindTexture(GL_TEXTURE_2D, textureId);
+		uploadTexture(width, height, image, internalFormat, mipmaps); // To GPU
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, mipmaps ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR); // sampling
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
 	}
 
-	void SetUniform(unsigned shaderProg, char * samplerName, unsigned int textureUnit = 0) {
-		int location = glGetUniformLocation(shaderProg, samplerName);
+	void SetUniform(unsigned shaderProg, const char * samplerName, unsigned int textureUnit = 0) {
+		int location = getUniformLocation(shaderProg, samplerName);
 		if (location >= 0) {
 			glUniform1i(location, textureUnit);
-			glActiveTexture(GL_TEXTURE0 + textureUnit);
-			glBindTexture(GL_TEXTURE_2D, textureId);
+			activeTexture(GL_TEXTURE0 + textureUnit);
+			bindTexture(GL_TEXTURE_2D, textureId);
 		}
 		else printf("uniform %s cannot be set\n", samplerName);
 	}
@@ -245,7 +451,7 @@ class GPUProgram {
 			delete log;
 		}
 	}
-	void checkShader(unsigned int shader, char * message) { 	// check if shader could be compiled
+	void checkShader(unsigned int shader, const char * message) { 	// check if shader could be compiled
 		int OK;
 		glGetShaderiv(shader, GL_COMPILE_STATUS, &OK);
 		if (!OK) { printf("%s!\n", message); getErrorInfo(shader); getchar(); }
@@ -261,6 +467,15 @@ public:
 	unsigned int getId() { return shaderProgramId; }
 
 	void Create(const char * const vertexSource, const char * const fragmentSource, const char * const fragmentShaderOutputName) {
+		TRACE_SCOPE("GPUProgram::Create");
+		// Binary of the same program from an earlier run
+		shaderProgramId = loadCachedProgram(vertexSource, fragmentSource, fragmentShaderOutputName);
+		if (shaderProgramId) {
+			registerUniforms(shaderProgramId);
+			useProgram(shaderProgramId);
+			return;
+		}
+
 		// Create vertex shader from string
 		unsigned int vertexShader = glCreateShader(GL_VERTEX_SHADER);
 		if (!vertexShader) {
@@ -289,6 +504,7 @@ public:
 		}
 		glAttachShader(shaderProgramId, vertexShader);
 		glAttachShader(shaderProgramId, fragmentShader);
+		prepareCachedProgram(shaderProgramId);
 
 		// Connect the fragmentColor to the frame buffer memory
 		glBindFragDataLocation(shaderProgramId, 0, fragmentShaderOutputName);	// this output goes to the frame buffer memory
@@ -296,14 +512,122 @@ public:
 		// program packaging
 		glLinkProgram(shaderProgramId);
 		checkLinking(shaderProgramId);
+		storeCachedProgram(shaderProgramId);
+		registerUniforms(shaderProgramId);
 
 		// make this program run
-		glUseProgram(shaderProgramId);
+		useProgram(shaderProgramId);
 	}
 
 	void Use() { 		// make this program run
-		glUseProgram(shaderProgramId);
+		useProgram(shaderProgramId);
+	}
+
+	~GPUProgram() {
+		unregisterUniforms(shaderProgramId);
+		deleteProgram(shaderProgramId);
 	}
+};
 
-	~GPUProgram() { glDeleteProgram(shaderProgramId); }
+// FixedStepSimulation steps on a worker thread; false with "-nosimthread" and with a headless -timestep, then the steps
+// run in Get on the render thread and follow GLUT_ELAPSED_TIME, which makes them deterministic
+extern bool simulationThreaded;
+
+//---------------------------
+template<typename State>
+class FixedStepSimulation {
+// Advances a State by fixed steps in real time on a worker thread. Every step publishes the previous and the new state
+// through three buffers, so neither side waits for the other, and Get blends the last two states for the render time.
+// step and interpolate may touch only the state: they run concurrently with the rest of the program.
+//---------------------------
+public:
+	typedef void (*StepFunction)(State& state, float dt);
+	typedef State (*InterpolateFunction)(const State& previous, const State& current, float alpha);
+private:
+	struct Snapshot {
+		State previous, current;
+		double time;			// simulation time of current in sec, previous is one step earlier
+	};
+	Snapshot snapshots[3];
+	int written = 0, ready = 1, read = 2;	// worker fills written, renderer uses read, ready is the newest complete one
+	bool fresh = false;						// ready is newer than read
+	std::mutex swapMutex;					// guards the three indices only
+	std::thread worker;
+	std::atomic<bool> running{ false };
+	std::chrono::steady_clock::time_point start;
+	StepFunction step = nullptr;
+	InterpolateFunction interpolate = nullptr;
+	float dt = 0;
+	long long nSteps = 0;
+	State latest;				// owned by the stepping thread
+	double startTime = 0;		// GLUT_ELAPSED_TIME at Start in sec, synchronous mode
+
+	double Clock() const {		// sec since Start
+		if (!simulationThreaded) return glutGet(GLUT_ELAPSED_TIME) / 1000.0 - startTime;
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	}
+	void Advance() {
+		Snapshot& snapshot = snapshots[written];
+		snapshot.previous = latest;
+		{
+			TRACE_SCOPE("FixedStepSimulation::Step");
+			step(latest, dt);
+		}
+		snapshot.current = latest;
+		snapshot.time = ++nSteps * (double)dt;
+		std::lock_guard<std::mutex> lock(swapMutex);
+		std::swap(written, ready);
+		fresh = true;
+	}
+	void Run() {
+		while (running) {
+			Advance();
+			// sleep until the next step is due; after slow steps there is no sleep, and the simulation runs behind
+			std::this_thread::sleep_until(start + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(nSteps * (double)dt)));
+		}
+	}
+public:
+	void Start(const State& initial, float _dt, StepFunction _step, InterpolateFunction _interpolate) {
+		Stop();
+		step = _step;
+		interpolate = _interpolate;
+		dt = _dt;
+		nSteps = 0;
+		latest = initial;
+		for (Snapshot& snapshot : snapshots) {
+			snapshot.previous = snapshot.current = initial;
+			snapshot.time = 0;
+		}
+		written = 0; ready = 1; read = 2;
+		fresh = false;
+		start = std::chrono::steady_clock::now();
+		startTime = simulationThreaded ? 0 : glutGet(GLUT_ELAPSED_TIME) / 1000.0;
+		if (simulationThreaded) {
+			running = true;
+			worker = std::thread(&FixedStepSimulation::Run, this);
+		}
+	}
+	void Stop() {
+		running = false;
+		if (worker.joinable()) worker.join();
+	}
+	~FixedStepSimulation() { Stop(); }
+
+	// The state one step behind the simulation clock, so that it lies between the two published states
+	State Get() {
+		double renderTime = Clock() - dt;
+		if (!simulationThreaded) while (nSteps * (double)dt < renderTime) Advance();		// renderTime then lies between the two newest states
+		{
+			std::lock_guard<std::mutex> lock(swapMutex);
+			if (fresh) {
+				std::swap(ready, read);
+				fresh = false;
+			}
+		}
+		const Snapshot& snapshot = snapshots[read];
+		float alpha = (dt > 0) ? (float)((renderTime - (snapshot.time - dt)) / dt) : 1;
+		if (alpha < 0) alpha = 0;
+		if (alpha > 1) alpha = 1;		// the simulation is late: its newest state
+		return interpolate(snapshot.previous, snapshot.current, alpha);
+	}
 };
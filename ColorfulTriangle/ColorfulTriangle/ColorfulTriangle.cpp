@@ -64,13 +64,13 @@ public:
 
 	void Create() {
 		glGenVertexArrays(1, &vao);	// create 1 vertex array object
-		glBindVertexArray(vao);		// make it active
+		bindVertexArray(vao);		// make it active
 
 		unsigned int vbo[2];		// vertex buffer objects
 		glGenBuffers(2, &vbo[0]);	// Generate 2 vertex buffer objects
 
 		// vertex coordinates: vbo[0] -> Attrib Array 0 -> vertexPosition of the vertex shader
-		glBindBuffer(GL_ARRAY_BUFFER, vbo[0]); // make it active, it is an array
+		bindBuffer(GL_ARRAY_BUFFER, vbo[0]); // make it active, it is an array
 		float vertexCoords[] = { -8, -8,  -6, 10,  8, -2 };	// vertex data on the CPU
 		glBufferData(GL_ARRAY_BUFFER,      // copy to the GPU
 			         sizeof(vertexCoords), // number of the vbo in bytes
@@ -85,7 +85,7 @@ public:
 							  0, NULL);     // stride and offset: it is tightly packed
 
 		// vertex colors: vbo[1] -> Attrib Array 1 -> vertexColor of the vertex shader
-		glBindBuffer(GL_ARRAY_BUFFER, vbo[1]); // make it active, it is an array
+		bindBuffer(GL_ARRAY_BUFFER, vbo[1]); // make it active, it is an array
 		float vertexColors[] = { 1, 0, 0,  0, 1, 0,  0, 0, 1 };	// vertex data on the CPU
 		glBufferData(GL_ARRAY_BUFFER, sizeof(vertexColors), vertexColors, GL_STATIC_DRAW);	// copy to the GPU
 		// Map Attribute Array 1 to the current bound vertex buffer (vbo[1])
@@ -125,8 +125,8 @@ public:
 		mat4 MVPTransform = M() * camera.V() * camera.P();
 		MVPTransform.SetUniform(gpuProgram.getId(), "MVP");
 
-		glBindVertexArray(vao);	// make the vao and its vbos active playing the role of the data source
-		glDrawArrays(GL_TRIANGLES, 0, 3);	// draw a single triangle with vertices defined in vao
+		bindVertexArray(vao);	// make the vao and its vbos active playing the role of the data source
+		drawArrays(GL_TRIANGLES, 0, 3);	// draw a single triangle with vertices defined in vao
 	}
 };
 
@@ -137,10 +137,10 @@ class LineStrip {
 public:
 	void Create() {
 		glGenVertexArrays(1, &vao);
-		glBindVertexArray(vao);
+		bindVertexArray(vao);
 
 		glGenBuffers(1, &vbo); // Generate 1 vertex buffer object
-		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		bindBuffer(GL_ARRAY_BUFFER, vbo);
 		// Enable the vertex attribute arrays
 		glEnableVertexAttribArray(0);  // attribute array 0
 		glEnableVertexAttribArray(1);  // attribute array 1
@@ -173,7 +173,7 @@ public:
 		vertexData.push_back(1); // green
 		vertexData.push_back(0); // blue
 		// copy data to the GPU
-		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		bindBuffer(GL_ARRAY_BUFFER, vbo);
 		glBufferData(GL_ARRAY_BUFFER, vertexData.size() * sizeof(float), &vertexData[0], GL_DYNAMIC_DRAW);
 	}
 
@@ -184,8 +184,8 @@ public:
 			// set GPU uniform matrix variable MVP with the content of CPU variable MVPTransform
 			mat4 MVPTransform = M() * camera.V() * camera.P();
 			MVPTransform.SetUniform(gpuProgram.getId(), "MVP");
-			glBindVertexArray(vao);
-			glDrawArrays(GL_LINE_STRIP, 0, vertexData.size() / 5);
+			bindVertexArray(vao);
+			drawArrays(GL_LINE_STRIP, 0, vertexData.size() / 5);
 		}
 	}
 };
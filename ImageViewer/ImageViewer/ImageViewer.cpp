@@ -250,12 +250,12 @@ public:
 	}
 	void Create() {
 		glGenVertexArrays(1, &vao);	// create 1 vertex array object
-		glBindVertexArray(vao);		// make it active
+		bindVertexArray(vao);		// make it active
 
 		glGenBuffers(1, &vbo);	// Generate 1 vertex buffer objects
 
 		// vertex coordinates: vbo[0] -> Attrib Array 0 -> vertexPosition of the vertex shader
-		glBindBuffer(GL_ARRAY_BUFFER, vbo); // make it active, it is an array
+		bindBuffer(GL_ARRAY_BUFFER, vbo); // make it active, it is an array
 		glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);	   // copy to that part of the memory which is not modified 
 		// Map Attribute Array 0 to the current bound vertex buffer (vbo[0])
 		glEnableVertexAttribArray(0);
@@ -266,7 +266,7 @@ public:
 
 		// Create objects by setting up their vertex data on the GPU
 		glGenTextures(1, &textureId);  				// id generation
-		glBindTexture(GL_TEXTURE_2D, textureId);    // binding
+		bindTexture(GL_TEXTURE_2D, textureId);    // binding
 
 		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGB, GL_FLOAT, &image[0]); // To GPU
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR); // sampling
@@ -274,25 +274,25 @@ public:
 	}
 
 	void Draw() {
-		glBindVertexArray(vao);	// make the vao and its vbos active playing the role of the data source
+		bindVertexArray(vao);	// make the vao and its vbos active playing the role of the data source
 
-		int location = glGetUniformLocation(shaderPrograms[effect].getId(), "texCursor");
+		int location = getUniformLocation(shaderPrograms[effect].getId(), "texCursor");
 		if (location >= 0) glUniform2f(location, texCursorPosition.x, texCursorPosition.y); // set uniform variable MVP to the MVPTransform
 		else printf("texCursor cannot be set\n");
 
-		location = glGetUniformLocation(shaderPrograms[effect].getId(), "textureUnit");
+		location = getUniformLocation(shaderPrograms[effect].getId(), "textureUnit");
 		if (location >= 0) {
 			glUniform1i(location, 0);		// texture sampling unit is TEXTURE0
-			glActiveTexture(GL_TEXTURE0);
-			glBindTexture(GL_TEXTURE_2D, textureId);	// connect the texture to the sampler
+			activeTexture(GL_TEXTURE0);
+			bindTexture(GL_TEXTURE_2D, textureId);	// connect the texture to the sampler
 		}
 		if (effect == WAVE) {
-			int location = glGetUniformLocation(shaderPrograms[effect].getId(), "waveTime");
+			int location = getUniformLocation(shaderPrograms[effect].getId(), "waveTime");
 			float waveTime = (glutGet(GLUT_ELAPSED_TIME) - cursorPressTime) / 1000.0f;
 			if (location >= 0) glUniform1f(location, waveTime); // set uniform variable MVP to the MVPTransform
 			else printf("waveTime cannot be set\n");
 		}
-		glDrawArrays(GL_TRIANGLE_FAN, 0, 4);	// draw two triangles forming a quad
+		drawArrays(GL_TRIANGLE_FAN, 0, 4);	// draw two triangles forming a quad
 	}
 };
 
@@ -58,7 +58,7 @@ struct Material {
 		ka.SetUniform(shaderProg, buffer);
 
 		sprintf(buffer, "%s.shininess", name);
-		int location = glGetUniformLocation(shaderProg, buffer);
+		int location = getUniformLocation(shaderProg, buffer);
 		if (location >= 0) glUniform1f(location, shininess); else printf("uniform shininess cannot be set\n");
 	}
 };
@@ -88,13 +88,12 @@ struct Light {
 struct CheckerBoardTexture : public Texture {
 	//---------------------------
 	CheckerBoardTexture(const int width = 0, const int height = 0) : Texture() {
-		glBindTexture(GL_TEXTURE_2D, textureId);    // binding
-		std::vector<vec3> image(width * height);
-		const vec3 yellow(1, 1, 0), blue(0, 0, 1);
+		std::vector<vec4> image(width * height);
+		const vec4 yellow(1, 1, 0, 1), blue(0, 0, 1, 1);
 		for (int x = 0; x < width; x++) for (int y = 0; y < height; y++) {
 			image[y * width + x] = (x & 1) ^ (y & 1) ? yellow : blue;
 		}
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, width, height, 0, GL_RGB, GL_FLOAT, &image[0]); //Texture->OpenGL
+		Upload(width, height, image, GL_RGBA8); //Texture->OpenGL
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
 		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
 	}
@@ -179,14 +178,14 @@ public:
 	GouraudShader() { Create(vertexSource, fragmentSource, "fragmentColor"); }
 
 	void Bind(RenderState state) {
-		glUseProgram(getId()); 		// make this program run
+		useProgram(getId()); 		// make this program run
 		state.MVP.SetUniform(getId(), "MVP");
 		state.M.SetUniform(getId(), "M");
 		state.Minv.SetUniform(getId(), "Minv");
 		state.wEye.SetUniform(getId(), "wEye");
 		state.material->SetUniform(getId(), "material");
 
-		int location = glGetUniformLocation(getId(), "nLights");
+		int location = getUniformLocation(getId(), "nLights");
 		if (location >= 0) glUniform1i(location, state.lights.size()); else printf("uniform nLight cannot be set\n");
 		for (int i = 0; i < state.lights.size(); i++) {
 			char buffer[256];
@@ -285,14 +284,14 @@ public:
 	PhongShader() { Create(vertexSource, fragmentSource, "fragmentColor"); }
 
 	void Bind(RenderState state) {
-		glUseProgram(getId()); 		// make this program run
+		useProgram(getId()); 		// make this program run
 		state.MVP.SetUniform(getId(), "MVP");
 		state.M.SetUniform(getId(), "M");
 		state.Minv.SetUniform(getId(), "Minv");
 		state.wEye.SetUniform(getId(), "wEye");
 		state.material->SetUniform(getId(), "material");
 
-		int location = glGetUniformLocation(getId(), "nLights");
+		int location = getUniformLocation(getId(), "nLights");
 		if (location >= 0) glUniform1i(location, state.lights.size()); else printf("uniform nLight cannot be set\n");
 		for (int i = 0; i < state.lights.size(); i++) {
 			char buffer[256];
@@ -353,7 +352,7 @@ public:
 	NPRShader() { Create(vertexSource, fragmentSource, "fragmentColor"); }
 
 	void Bind(RenderState state) {
-		glUseProgram(getId()); 		// make this program run
+		useProgram(getId()); 		// make this program run
 		state.MVP.SetUniform(getId(), "MVP");
 		state.M.SetUniform(getId(), "M");
 		state.Minv.SetUniform(getId(), "Minv");
@@ -379,7 +378,7 @@ protected:
 public:
 	Geometry() {
 		glGenVertexArrays(1, &vao);
-		glBindVertexArray(vao);
+		bindVertexArray(vao);
 	}
 	virtual void Draw() = 0;
 };
@@ -395,9 +394,10 @@ public:
 	virtual VertexData GenVertexData(float u, float v) = 0;
 
 	void Create(int N = tessellationLevel, int M = tessellationLevel) {
+		TRACE_SCOPE("ParamSurface::Create");
 		unsigned int vbo;
 		glGenBuffers(1, &vbo); // Generate 1 vertex buffer object
-		glBindBuffer(GL_ARRAY_BUFFER, vbo);
+		bindBuffer(GL_ARRAY_BUFFER, vbo);
 		nVtxPerStrip = (M + 1) * 2;
 		nStrips = N;
 		std::vector<VertexData> vtxData;	// vertices on the CPU
@@ -418,8 +418,8 @@ public:
 		glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(VertexData), (void*)offsetof(VertexData, texcoord));
 	}
 	void Draw() {
-		glBindVertexArray(vao);
-		for (int i = 0; i < nStrips; i++) glDrawArrays(GL_TRIANGLE_STRIP, i *  nVtxPerStrip, nVtxPerStrip);
+		bindVertexArray(vao);
+		for (int i = 0; i < nStrips; i++) drawArrays(GL_TRIANGLE_STRIP, i *  nVtxPerStrip, nVtxPerStrip);
 	}
 };
 
@@ -522,27 +522,44 @@ public:
 	}
 
 	void Draw(RenderState state) {
-		state.M = ScaleMatrix(scale) * RotationMatrix(rotationAngle, rotationAxis) * TranslateMatrix(translation);
-		state.Minv = TranslateMatrix(-translation) * RotationMatrix(-rotationAngle, rotationAxis) * ScaleMatrix(vec3(1 / scale.x, 1 / scale.y, 1 / scale.z));
+		Affine model = ScaleAffine(scale) * RotationAffine(rotationAngle, rotationAxis) * TranslateAffine(translation);
+		state.M = model;
+		state.Minv = model.inverse();
 		state.MVP = state.M * state.V * state.P;
 		state.material = material;
 		state.texture = texture;
-		shader->Bind(state);
+		{
+			TRACE_SCOPE("Shader::Bind");
+			shader->Bind(state);
+		}
+		TRACE_SCOPE("Geometry::Draw");
 		geometry->Draw();
 	}
 
 	void Animate(float tstart, float tend) { rotationAngle = 0.8 * tend; }
 };
 
+const float simulationStep = 0.01f;	// sec, "infinitesimal"
+
+// The animated part of the scene, copied for the simulation thread
+struct SceneState {
+	float time = 0;
+	Camera camera;
+	std::vector<Light> lights;
+	std::vector<Object> objects;
+};
+
 //---------------------------
 class Scene {
 	//---------------------------
 	std::vector<Object *> objects;
+	FixedStepSimulation<SceneState> simulation;
 public:
 	Camera camera; // 3D camera
 	std::vector<Light> lights;
 
 	void Build() {
+		TRACE_SCOPE("Scene::Build");
 		// Shaders
 		Shader * phongShader = new PhongShader();
 		Shader * gouraudShader = new GouraudShader();
@@ -638,20 +655,45 @@ public:
 		lights[2].La = vec3(0.1, 0.1, 0.1);
 		lights[2].Le = vec3(0, 0, 3);
 
+		// Animation
+		SceneState initial;
+		initial.camera = camera;
+		initial.lights = lights;
+		for (Object * obj : objects) initial.objects.push_back(*obj);
+		simulation.Start(initial, simulationStep, Animate, Interpolate);
 	}
 	void Render() {
+		TRACE_SCOPE("Scene::Render");
+		SceneState current = simulation.Get();
 		RenderState state;
-		state.wEye = camera.wEye;
-		state.V = camera.V();
-		state.P = camera.P();
-		state.lights = lights;
-		for (Object * obj : objects) obj->Draw(state);
+		state.wEye = current.camera.wEye;
+		state.V = current.camera.V();
+		state.P = current.camera.P();
+		state.lights = current.lights;
+		for (Object& obj : current.objects) obj.Draw(state);
 	}
 
-	void Animate(float tstart, float tend) {
-		camera.Animate(tend);
-		for (int i = 0; i < lights.size(); i++) { lights[i].Animate(tend); }
-		for (Object * obj : objects) obj->Animate(tstart, tend);
+	static void Animate(SceneState& state, float dt) {
+		TRACE_SCOPE("Scene::Animate");
+		float tstart = state.time, tend = state.time += dt;
+		state.camera.Animate(tend);
+		for (int i = 0; i < state.lights.size(); i++) { state.lights[i].Animate(tend); }
+		for (Object& obj : state.objects) obj.Animate(tstart, tend);
+	}
+
+	static SceneState Interpolate(const SceneState& previous, const SceneState& current, float alpha) {
+		SceneState state = current;
+		state.time = previous.time + (current.time - previous.time) * alpha;
+		state.camera.wEye = previous.camera.wEye + (current.camera.wEye - previous.camera.wEye) * alpha;
+		state.camera.wLookat = previous.camera.wLookat + (current.camera.wLookat - previous.camera.wLookat) * alpha;
+		for (int i = 0; i < state.lights.size(); i++)
+			state.lights[i].wLightPos = previous.lights[i].wLightPos + (current.lights[i].wLightPos - previous.lights[i].wLightPos) * alpha;
+		for (int i = 0; i < state.objects.size(); i++) {
+			const Object& o0 = previous.objects[i], & o1 = current.objects[i];
+			state.objects[i].rotationAngle = o0.rotationAngle + (o1.rotationAngle - o0.rotationAngle) * alpha;
+			state.objects[i].translation = o0.translation + (o1.translation - o0.translation) * alpha;
+		}
+		return state;
 	}
 };
 
@@ -660,8 +702,8 @@ Scene scene;
 // Initialization, create an OpenGL context
 void onInitialization() {
 	glViewport(0, 0, windowWidth, windowHeight);
-	glEnable(GL_DEPTH_TEST);
-	glDisable(GL_CULL_FACE);
+	setEnabled(GL_DEPTH_TEST, true);
+	setEnabled(GL_CULL_FACE, false);
 	scene.Build();
 }
 
@@ -686,16 +728,7 @@ void onMouse(int button, int state, int pX, int pY) { }
 void onMouseMotion(int pX, int pY) {
 }
 
-// Idle event indicating that some time elapsed: do animation here
+// Idle event indicating that some time elapsed: the scene animates on the simulation thread
 void onIdle() {
-	static float tend = 0;
-	const float dt = 0.1; // dt is infinitesimal
-	float tstart = tend;
-	tend = glutGet(GLUT_ELAPSED_TIME) / 1000.0f;
-
-	for (float t = tstart; t < tend; t += dt) {
-		float Dt = fmin(dt, tend - t);
-		scene.Animate(t, t + Dt);
-	}
 	glutPostRedisplay();
 }
\ No newline at end of file
@@ -6,6 +6,27 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <atomic>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+#if !defined(_WIN32)
+#include <unistd.h>		// distributed rendering over POSIX sockets
+#include <signal.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+#include "trace.h"		// "-trace file.json" writes the TRACE_SCOPE("name") blocks of the rendering phases
 
 const unsigned int screenWidth = 600, screenHeight = 600;	// resolution of the rendered image
 const double epsilon = 1e-5;	// limit of considering a number to be zero
@@ -13,6 +34,21 @@ const int maxdepth = 10;		// max depth of recursion
 const int nSamples = 50;		// number of path samples per pixel
 const int nMaxObjects = 10;		// maximum number of objects
 const int nMaxLights = 10;		// maximum number of light sources
+const int nCausticPhotons = 200000;	// default number of photons shot towards specular objects per light
+const int nGatherPhotons = 100;		// number of nearest photons used in a radiance estimate
+const double maxGatherRadius = 0.1;	// photons farther than this are never gathered
+const int nBootstrap = 100000;		// number of independent paths estimating the normalization of Metropolis sampling
+const double largeStepProb = 0.3;	// probability of a large step mutation in Metropolis sampling
+const int nGuidingIterations = 4;	// training iterations of path guiding with 1, 2, 4, ... samples per pixel
+const double guidingProb = 0.5;		// probability of sampling the learned distribution instead of the cosine one
+const double cacheError = 0.2;		// allowed error of irradiance cache interpolation (Ward's a)
+const int nCacheThetaStrata = 12, nCachePhiStrata = 36;	// hemisphere strata of an irradiance record
+const double minCacheSpacing = 0.02, maxCacheSpacing = 1.0;	// limits of the harmonic mean distance of a record
+const int tileSize = 32;			// edge of the image tiles of distributed rendering
+const int defaultPort = 5555;		// port of the coordinator of distributed rendering
+const double minTileTimeout = 30;	// sec, a worker is dropped if its tile takes longer than this and 10 times the slowest one
+const double workerWaitTimeout = 10;	// sec without any worker, after which the coordinator renders tiles itself
+const int messageTimeout = 5;		// sec, a worker that stops in the middle of a message is dropped
 
 // 3D vector operations
 struct vec3 {
@@ -23,6 +59,7 @@ struct vec3 {
 	vec3 operator+(const vec3& v) const { return vec3(x + v.x, y + v.y, z + v.z); }
 	void operator+=(const vec3& v) { x += v.x; y += v.y; z += v.z; }
 	vec3 operator-(const vec3& v) const { return vec3(x - v.x, y - v.y, z - v.z); }
+	double operator[](int axis) const { return (axis == 0) ? x : (axis == 1) ? y : z; }
 	vec3 operator*(const vec3& v) const { return vec3(x * v.x, y * v.y, z * v.z); }
 	vec3 operator-() const { return vec3(-x, -y, -z); }
 	vec3 normalize() const { return (*this) * (1 / (Length() + epsilon)); }
@@ -38,8 +75,41 @@ vec3 cross(const vec3& v1, const vec3& v2) {	// cross product
 	return vec3(v1.y * v2.z - v1.z * v2.y, v1.z * v2.x - v1.x * v2.z, v1.x * v2.y - v1.y * v2.x);
 }
 
-// Pseudo-random number in [0,1)
-double random() { return (double)rand() / RAND_MAX; }
+// Source of the random numbers consumed while sampling a path. Parallel loops give every thread its own sampler seeded
+// from the loop (stream) and the thread, so threads share no generator and a run repeats with the same thread count.
+class Sampler {
+	std::mt19937 rng;
+public:
+	Sampler(unsigned int stream = 0, unsigned int thread = 0) {
+		std::seed_seq seed = { stream, thread };
+		rng.seed(seed);
+	}
+	virtual double next() { return std::uniform_real_distribution<double>(0, 1)(rng); }	// independent samples
+};
+
+// Number of threads rendering in parallel and the index of the calling one
+int ThreadCount() {
+#ifdef _OPENMP
+	return omp_get_max_threads();
+#else
+	return 1;
+#endif
+}
+int ThreadIndex() {
+#ifdef _OPENMP
+	return omp_get_thread_num();
+#else
+	return 0;
+#endif
+}
+
+enum Counter { CAMERA_SAMPLES, RAYS, INTERSECTION_TESTS, SHADOW_RAYS, BOUNCES, ROULETTE_TERMINATIONS, nCounters };
+
+// Counters of one rendering thread, aligned to a cache line so that threads do not write the same line
+struct alignas(64) RenderStats {
+	long long count[nCounters];
+	RenderStats() { for (int c = 0; c < nCounters; c++) count[c] = 0; }
+};
 
 // Material class
 struct Material {
@@ -53,18 +123,15 @@ struct Material {
 };
 
 // sample direction with cosine distribution, returns the pdf
-double SampleDiffuse(const vec3& N, const vec3& inDir, vec3& outDir) {
+double SampleDiffuse(const vec3& N, const vec3& inDir, vec3& outDir, Sampler& sampler) {
 	vec3 T = cross(N, vec3(1, 0, 0));	// Find a Cartesian frame T, B, N where T, B are in the plane
 	if (T.Length() < epsilon) T = cross(N, vec3(0, 0, 1));
 	T = T.normalize();
 	vec3 B = cross(N, T);
 
-	double x, y, z;
-	do {
-		x = 2 * random() - 1;    // random point in [-1,-1;1,1]
-		y = 2 * random() - 1;
-	} while (x*x + y * y > 1);  // reject if not in circle
-	z = sqrt(1 - x * x - y * y);  // project to hemisphere
+	double r = sqrt(sampler.next()), phi = 2 * M_PI * sampler.next();	// uniform point in the unit circle
+	double x = r * cos(phi), y = r * sin(phi);	// (always two numbers, so that Metropolis mutations stay local)
+	double z = sqrt(fmax(0, 1 - x * x - y * y));  // project to hemisphere
 
 	outDir = N * z + T * x + B * y;
 	return z / M_PI;	// pdf
@@ -97,7 +164,17 @@ protected:
 	Material * material;
 public:
 	Intersectable(Material * mat) { material = mat; }
-	virtual Hit intersect(const Ray& ray) = 0;
+	// ray parameter of the intersection, negative if there is none; cheap, called for every candidate
+	virtual double intersectT(const Ray& ray) = 0;
+	// position, normal and material of the intersection at ray parameter t; called once for the closest hit
+	virtual Hit surface(const Ray& ray, double t) = 0;
+	Hit intersect(const Ray& ray) {
+		double t = intersectT(ray);
+		return (t > 0) ? surface(ray, t) : Hit();
+	}
+	// bounding sphere of the object, false if the object is unbounded
+	virtual bool bound(vec3& center, double& radius) { return false; }
+	bool isSpecular() { return material->mirrorAlbedo.average() > epsilon; }
 };
 
 // Sphere with two materials to support texturing
@@ -111,22 +188,25 @@ struct Sphere : public Intersectable {
 		radius = _radius;
 		material2 = mat2;
 	}
-	Hit intersect(const Ray& ray) {
-		Hit hit;
+	double intersectT(const Ray& ray) {
 		vec3 dist = ray.start - center;
 		double b = dot(dist, ray.dir) * 2.0;
 		double a = dot(ray.dir, ray.dir);
 		double c = dot(dist, dist) - radius * radius;
 		double discr = b * b - 4.0 * a * c;
-		if (discr < 0) return hit;
+		if (discr < 0) return -1;
 		double sqrt_discr = sqrt(discr);
 		double t1 = (-b + sqrt_discr) / 2.0 / a;
 		double t2 = (-b - sqrt_discr) / 2.0 / a;
-		if (t1 <= 0 && t2 <= 0) return hit;
-		if (t1 <= 0 && t2 > 0)       hit.t = t2;
-		else if (t2 <= 0 && t1 > 0)  hit.t = t1;
-		else if (t1 < t2)            hit.t = t1;
-		else                         hit.t = t2;
+		if (t1 <= 0 && t2 <= 0) return -1;
+		if (t1 <= 0 && t2 > 0)       return t2;
+		else if (t2 <= 0 && t1 > 0)  return t1;
+		else if (t1 < t2)            return t1;
+		else                         return t2;
+	}
+	Hit surface(const Ray& ray, double t) {
+		Hit hit;
+		hit.t = t;
 		hit.position = ray.start + ray.dir * hit.t;
 		hit.normal = (hit.position - center) / radius;
 		if (dot(hit.normal, ray.dir) > 0) hit.normal = hit.normal * (-1); // flip the normal, we are inside the sphere
@@ -139,6 +219,11 @@ struct Sphere : public Intersectable {
 		}
 		return hit;
 	}
+	bool bound(vec3& _center, double& _radius) {
+		_center = center;
+		_radius = radius;
+		return true;
+	}
 };
 
 // Plane
@@ -149,12 +234,14 @@ struct Plane : public Intersectable {
 		point = _point;
 		normal = _normal.normalize();
 	}
-	Hit intersect(const Ray& ray) {
-		Hit hit;
+	double intersectT(const Ray& ray) {
 		double NdotV = dot(normal, ray.dir);
-		if (fabs(NdotV) < epsilon) return hit;
+		if (fabs(NdotV) < epsilon) return -1;
 		double t = dot(normal, point - ray.start) / NdotV;
-		if (t < epsilon) return hit;
+		return (t < epsilon) ? -1 : t;
+	}
+	Hit surface(const Ray& ray, double t) {
+		Hit hit;
 		hit.t = t;
 		hit.position = ray.start + ray.dir * hit.t;
 		hit.normal = normal;
@@ -204,14 +291,531 @@ struct Light {
 	}
 };
 
+// Photon landed on a diffuse surface
+struct Photon {
+	vec3 position;	// hit point
+	vec3 dir;		// direction of arrival
+	vec3 power;		// carried flux
+	int axis;		// splitting axis of the kd-tree node
+};
+
+// Balanced kd-tree of photons stored in a flat array: the node of range [lo, hi) is its median,
+// the two halves are the subtrees, so no pointers are needed and siblings are close in memory
+class PhotonMap {
+	std::vector<Photon> photons;
+
+	void balance(int lo, int hi) {
+		if (hi - lo <= 1) return;
+		vec3 bmin = photons[lo].position, bmax = photons[lo].position;
+		for (int i = lo + 1; i < hi; i++) {
+			const vec3& p = photons[i].position;
+			bmin = vec3(fmin(bmin.x, p.x), fmin(bmin.y, p.y), fmin(bmin.z, p.z));
+			bmax = vec3(fmax(bmax.x, p.x), fmax(bmax.y, p.y), fmax(bmax.z, p.z));
+		}
+		vec3 extent = bmax - bmin;	// split along the largest extent
+		int axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z) ? 1 : 2;
+		int mid = (lo + hi) / 2;
+		std::nth_element(photons.begin() + lo, photons.begin() + mid, photons.begin() + hi,
+			[axis](const Photon& p1, const Photon& p2) { return p1.position[axis] < p2.position[axis]; });
+		photons[mid].axis = axis;
+		balance(lo, mid);
+		balance(mid + 1, hi);
+	}
+
+	// k nearest photons kept in a max-heap of squared distances
+	struct NearestPhotons {
+		std::pair<double, const Photon *> heap[nGatherPhotons];
+		int n;
+		double maxDist2;	// search radius, shrinks when the heap is full
+		NearestPhotons(double _maxDist2) { n = 0; maxDist2 = _maxDist2; }
+		void insert(const Photon * photon, double dist2) {
+			if (n < nGatherPhotons) {
+				heap[n++] = std::make_pair(dist2, photon);
+				std::push_heap(heap, heap + n);
+				if (n == nGatherPhotons) maxDist2 = heap[0].first;
+			}
+			else {
+				std::pop_heap(heap, heap + n);
+				heap[n - 1] = std::make_pair(dist2, photon);
+				std::push_heap(heap, heap + n);
+				maxDist2 = heap[0].first;
+			}
+		}
+	};
+
+	void locate(int lo, int hi, const vec3& x, NearestPhotons& np) const {
+		if (lo >= hi) return;
+		int mid = (lo + hi) / 2;
+		const Photon& photon = photons[mid];
+		if (hi - lo > 1) {
+			double delta = x[photon.axis] - photon.position[photon.axis];
+			if (delta < 0) {	// visit the near side first, the far side only if the search sphere reaches it
+				locate(lo, mid, x, np);
+				if (delta * delta < np.maxDist2) locate(mid + 1, hi, x, np);
+			}
+			else {
+				locate(mid + 1, hi, x, np);
+				if (delta * delta < np.maxDist2) locate(lo, mid, x, np);
+			}
+		}
+		vec3 diff = photon.position - x;
+		double dist2 = dot(diff, diff);
+		if (dist2 < np.maxDist2) np.insert(&photon, dist2);
+	}
+public:
+	void clear() { photons.clear(); }
+	void store(const std::vector<Photon>& _photons) { photons.insert(photons.end(), _photons.begin(), _photons.end()); }
+	int size() { return photons.size(); }
+	void build() { balance(0, photons.size()); }
+
+	// Reflected radiance of a diffuse surface from the nearest photons
+	vec3 radianceEstimate(const vec3& position, const vec3& N, const vec3& diffuseAlbedo) const {
+		NearestPhotons np(maxGatherRadius * maxGatherRadius);
+		locate(0, photons.size(), position, np);
+		vec3 flux(0, 0, 0);
+		for (int i = 0; i < np.n; i++) {
+			const Photon * photon = np.heap[i].second;
+			if (dot(photon->dir, N) < 0) flux += photon->power;	// arrived from the front side
+		}
+		if (np.n == 0) return flux;
+		return diffuseAlbedo / M_PI * flux / (M_PI * np.maxDist2);
+	}
+};
+
+// Vertex of a camera or light subpath of bidirectional path tracing
+struct PathVertex {
+	vec3 position;
+	vec3 normal;		// surface normal facing the arriving subpath, zero for the camera and the point light
+	Material * material;	// NULL for the camera and the light
+	vec3 beta;			// throughput of the subpath up to this vertex
+	double pdfFwd;		// area density of sampling this vertex from the previous one of the subpath
+	double pdfRev;		// area density of sampling it from the next one, i.e. by the other subpath
+	bool delta;			// the outgoing direction was sampled from the mirror lobe
+
+	PathVertex() { material = NULL; pdfFwd = pdfRev = 0; delta = false; }
+	bool isSurface() const { return material != NULL; }
+	bool isConnectible() const { return !isSurface() || material->diffuseAlbedo.average() > epsilon; }
+};
+
+// Solid angle density of sampling direction from -> to at vertex "from", then converted to area density at "to"
+double ConvertDensity(double pdfDir, const PathVertex& from, const PathVertex& to) {
+	vec3 w = to.position - from.position;
+	double distance2 = dot(w, w);
+	if (distance2 < epsilon) return 0;
+	if (to.isSurface()) pdfDir *= fabs(dot(to.normal, w / sqrt(distance2)));
+	return pdfDir / distance2;
+}
+
+// Solid angle density of leaving a surface vertex in direction dir with the diffuse lobe of the walk
+double DiffuseDirectionPdf(const PathVertex& vertex, const vec3& dir) {
+	double cosTheta = dot(vertex.normal, dir);
+	if (cosTheta <= 0) return 0;
+	return vertex.material->diffuseAlbedo.average() * cosTheta / M_PI;
+}
+
+// Pdf ratios of the delta vertices are zero, they are counted as one not to break the chain of ratios
+inline double remap0(double pdf) { return (pdf != 0) ? pdf : 1; }
+
+enum Integrator { PATH_TRACING, BIDIRECTIONAL, METROPOLIS };
+
+// Rectangle of pixels rendered by a worker of distributed rendering
+struct Tile {
+	int x0, y0, width, height;
+};
+
+// Quadtree approximating the incident radiance over the sphere of directions; directions are mapped to the unit square by
+// (cos theta, phi), which preserves area, so the density of a leaf is uniform on the sphere too
+class DTree {
+	struct Node {
+		double sum[4];	// recorded radiance in the quadrants
+		int child[4];	// node of the quadrant, 0 for a leaf
+		Node() { for (int q = 0; q < 4; q++) { sum[q] = 0; child[q] = 0; } }
+		double total() const { return sum[0] + sum[1] + sum[2] + sum[3]; }
+	};
+	std::vector<Node> nodes;	// nodes[0] is the root
+
+	static int quadrant(double& u, double& v) {	// quadrant of a point and its coordinates in the quadrant
+		int q = 0;
+		if (u >= 0.5) { q += 1; u -= 0.5; }
+		if (v >= 0.5) { q += 2; v -= 0.5; }
+		u *= 2; v *= 2;
+		return q;
+	}
+	static void toSquare(const vec3& dir, double& u, double& v) {
+		u = fmin(fmax((dir.z + 1) / 2, 0), 0.999999);
+		v = atan2(dir.y, dir.x) / (2 * M_PI);
+		if (v < 0) v += 1;
+		v = fmin(v, 0.999999);
+	}
+
+	// create the children of the new node n where the energy of the quadrant (estimated from the old tree) is significant
+	void refine(const DTree& old, int oldNode, double nodeSum, double total, int n, int depth) {
+		const double rho = 0.01;	// a quadrant holding more than this fraction of the energy is subdivided
+		const int maxDepth = 20;
+		for (int q = 0; q < 4; q++) {
+			double sum = (oldNode >= 0) ? old.nodes[oldNode].sum[q] : nodeSum / 4;
+			int oldChild = (oldNode >= 0 && old.nodes[oldNode].child[q] > 0) ? old.nodes[oldNode].child[q] : -1;
+			if (depth < maxDepth && sum > rho * total) {
+				int child = nodes.size();
+				nodes.push_back(Node());
+				nodes[n].child[q] = child;
+				refine(old, oldChild, sum, total, child, depth + 1);
+			}
+		}
+	}
+public:
+	DTree() { nodes.push_back(Node()); }
+	double total() const { return nodes[0].total(); }
+
+	void record(const vec3& dir, double radiance) {	// called from several threads
+		double u, v;
+		toSquare(dir, u, v);
+		int n = 0;
+		while (true) {
+			int q = quadrant(u, v);
+#pragma omp atomic
+			nodes[n].sum[q] += radiance;
+			if (nodes[n].child[q] == 0) break;
+			n = nodes[n].child[q];
+		}
+	}
+
+	double pdf(const vec3& dir) const {	// solid angle density
+		double u, v;
+		toSquare(dir, u, v);
+		double p = 1 / (4 * M_PI);
+		int n = 0;
+		while (true) {
+			double total = nodes[n].total();
+			if (total <= 0) break;
+			int q = quadrant(u, v);
+			p *= 4 * nodes[n].sum[q] / total;
+			if (nodes[n].child[q] == 0) break;
+			n = nodes[n].child[q];
+		}
+		return p;
+	}
+
+	vec3 sample(double r1, double r2) const {	// direction with density pdf()
+		double u0 = 0, v0 = 0, size = 1;	// square of the current node
+		int n = 0;
+		while (true) {
+			const Node& node = nodes[n];
+			double total = node.total();
+			if (total <= 0) break;
+			double left = node.sum[0] + node.sum[2];
+			int q = 0;
+			if (r1 * total < left) r1 = r1 * total / left;	// select the column, then the row, and reuse the random numbers
+			else { r1 = (r1 * total - left) / (total - left); q += 1; }
+			double bottom = (q == 0) ? node.sum[0] : node.sum[1], top = (q == 0) ? node.sum[2] : node.sum[3];
+			if (r2 * (bottom + top) < bottom) r2 = r2 * (bottom + top) / bottom;
+			else { r2 = (r2 * (bottom + top) - bottom) / top; q += 2; }
+			size /= 2;
+			if (q & 1) u0 += size;
+			if (q & 2) v0 += size;
+			if (node.child[q] == 0) break;
+			n = node.child[q];
+		}
+		double z = 2 * (u0 + r1 * size) - 1, phi = 2 * M_PI * (v0 + r2 * size);
+		double r = sqrt(fmax(0, 1 - z * z));
+		return vec3(r * cos(phi), r * sin(phi), z);
+	}
+
+	// Tree for the next iteration: subdivided where this one has much energy, with zero sums
+	DTree refined() const {
+		DTree tree;
+		if (total() > 0) tree.refine(*this, 0, total(), total(), 0, 1);
+		return tree;
+	}
+	int size() const { return nodes.size(); }
+};
+
+// Spatial-directional tree of path guiding: a binary tree subdividing the scene, the leaves store the directional
+// distribution learnt in the previous iteration (sampling) and the one collected in the current iteration (building)
+class PathGuide {
+	struct Node {
+		int axis;		// splitting axis, the halves are children[0] and children[1]
+		int children[2];
+		int leaf;		// index of the leaf data, -1 for inner nodes
+	};
+	struct Leaf {
+		DTree sampling, building;
+		int nRecords;
+	};
+	std::vector<Node> nodes;
+	std::vector<Leaf> leaves;
+	vec3 boxMin, boxSize;
+	int iteration;
+
+	int leafOf(const vec3& position) const {
+		vec3 p = position - boxMin;
+		double c[3] = { p.x / boxSize.x, p.y / boxSize.y, p.z / boxSize.z };
+		int n = 0;
+		while (nodes[n].leaf < 0) {
+			int axis = nodes[n].axis;
+			int side = (c[axis] >= 0.5) ? 1 : 0;
+			c[axis] = (c[axis] - 0.5 * side) * 2;
+			n = nodes[n].children[side];
+		}
+		return nodes[n].leaf;
+	}
+	void split(int n) {	// the two halves inherit the distributions of the leaf and half of its records
+		Node node = nodes[n];
+		leaves[node.leaf].nRecords /= 2;
+		for (int side = 0; side < 2; side++) {
+			Node child;
+			child.axis = (node.axis + 1) % 3;
+			child.children[0] = child.children[1] = -1;
+			child.leaf = (side == 0) ? node.leaf : leaves.size();
+			if (side == 1) leaves.push_back(leaves[node.leaf]);
+			nodes[n].children[side] = nodes.size();
+			nodes.push_back(child);
+		}
+		nodes[n].leaf = -1;
+	}
+public:
+	PathGuide() { iteration = 0; }
+
+	void init(const vec3& _boxMin, const vec3& _boxMax) {
+		boxMin = _boxMin;
+		boxSize = _boxMax - _boxMin;
+		nodes.clear();
+		leaves.clear();
+		Node root;
+		root.axis = 0;
+		root.children[0] = root.children[1] = -1;
+		root.leaf = 0;
+		nodes.push_back(root);
+		Leaf leaf;
+		leaf.nRecords = 0;
+		leaves.push_back(leaf);
+		iteration = 0;
+	}
+
+	// Incident radiance estimate arriving from direction dir at position
+	void record(const vec3& position, const vec3& dir, double radiance) {
+		Leaf& leaf = leaves[leafOf(position)];
+		leaf.building.record(dir, radiance);
+#pragma omp atomic
+		leaf.nRecords++;
+	}
+
+	// Sample the learnt distribution or the cosine one, returns the density of the mixture (one-sample MIS)
+	double sample(const vec3& position, const vec3& N, const vec3& inDir, vec3& outDir, Sampler& sampler) const {
+		const DTree& dtree = leaves[leafOf(position)].sampling;
+		if (dtree.total() <= 0) return SampleDiffuse(N, inDir, outDir, sampler);
+		if (sampler.next() < guidingProb) {
+			double r1 = sampler.next(), r2 = sampler.next();
+			outDir = dtree.sample(r1, r2);
+		}
+		else SampleDiffuse(N, inDir, outDir, sampler);
+		return guidingProb * dtree.pdf(outDir) + (1 - guidingProb) * fmax(dot(N, outDir), 0) / M_PI;
+	}
+
+	// End of an iteration: subdivide the leaves with many records, then what was learnt becomes the sampling distribution
+	void update() {
+		iteration++;
+		double threshold = 12000 * sqrt(pow(2.0, iteration - 1));	// the samples per pixel double in every iteration
+		for (int n = 0; n < nodes.size(); n++) {	// the new nodes are visited as well
+			if (nodes[n].leaf >= 0 && leaves[nodes[n].leaf].nRecords > threshold) split(n);
+		}
+		int nDirectionalNodes = 0;
+		for (int l = 0; l < leaves.size(); l++) {
+			leaves[l].sampling = leaves[l].building;
+			leaves[l].building = leaves[l].sampling.refined();
+			leaves[l].nRecords = 0;
+			nDirectionalNodes += leaves[l].sampling.size();
+		}
+		printf("guiding: %d spatial leaves, %d directional nodes\n", (int)leaves.size(), nDirectionalNodes);
+	}
+};
+
+// Primary sample space Metropolis sampler: the random numbers of a path form a vector that is mutated by
+// small perturbations or replaced by a large step; coordinates are mutated lazily when trace() asks for them
+class MetropolisSampler : public Sampler {
+	struct PrimarySample {
+		double value, backup;
+		int lastModified, backupModified;	// iteration of the last mutation
+		PrimarySample() { value = backup = 0; lastModified = backupModified = 0; }
+	};
+	std::vector<PrimarySample> X;
+	std::mt19937 rng;		// every chain has its own generator
+	int currentIteration, lastLargeStepIteration, sampleIndex;
+	bool largeStep;
+
+	double uniform() { return std::uniform_real_distribution<double>(0, 1)(rng); }
+
+	void mutate(PrimarySample& Xi) {
+		if (Xi.lastModified < lastLargeStepIteration) {	// a large step happened since the last use
+			Xi.value = uniform();
+			Xi.lastModified = lastLargeStepIteration;
+		}
+		Xi.backup = Xi.value;
+		Xi.backupModified = Xi.lastModified;
+		if (largeStep) Xi.value = uniform();
+		else {	// the skipped small steps together are a normal perturbation with the summed variance
+			const double sigma = 0.01;
+			int nSmall = currentIteration - Xi.lastModified;
+			double gauss = std::normal_distribution<double>(0, 1)(rng);
+			Xi.value += gauss * sigma * sqrt((double)nSmall);
+			Xi.value -= floor(Xi.value);	// wrap around
+		}
+		Xi.lastModified = currentIteration;
+	}
+public:
+	MetropolisSampler(unsigned int seed) : rng(seed) {
+		currentIteration = lastLargeStepIteration = sampleIndex = 0;
+		largeStep = true;
+	}
+	void startIteration(bool _largeStep) {
+		currentIteration++;
+		largeStep = _largeStep;
+		sampleIndex = 0;
+	}
+	void accept() { if (largeStep) lastLargeStepIteration = currentIteration; }
+	void reject() {
+		for (int i = 0; i < X.size(); i++) {
+			if (X[i].lastModified == currentIteration) {
+				X[i].value = X[i].backup;
+				X[i].lastModified = X[i].backupModified;
+			}
+		}
+		currentIteration--;
+	}
+	double next() {
+		if (sampleIndex >= X.size()) X.resize(sampleIndex + 1);
+		PrimarySample& Xi = X[sampleIndex++];
+		if (Xi.lastModified < currentIteration) mutate(Xi);
+		return Xi.value;
+	}
+	double random01() { return uniform(); }	// for the decisions of the chain, not part of the path
+};
+
+// Irradiance at a point with the gradients of Ward and Heckbert; a gradient is stored as the color derivative along x, y, z
+struct IrradianceRecord {
+	vec3 position, normal;
+	vec3 E;						// irradiance
+	vec3 rotGradient[3];		// change of E when the normal rotates around x, y, z
+	vec3 transGradient[3];		// change of E when the point moves along x, y, z
+	double R;					// harmonic mean distance of the visible surfaces
+};
+
+// Records of the irradiance cache in an octree; records are only added, never removed, so lookups run lock-free
+// while other threads insert: child nodes and list elements are published with compare and swap
+class IrradianceCache {
+	struct RecordLink {
+		IrradianceRecord * record;
+		RecordLink * next;
+	};
+	struct Node {
+		std::atomic<Node *> children[8];
+		std::atomic<RecordLink *> records;
+		Node() { for (int i = 0; i < 8; i++) children[i] = NULL; records = NULL; }
+	};
+	Node * root;
+	vec3 rootCenter;
+	double rootHalfSize;
+	std::atomic<int> nRecords;
+
+	static vec3 childCenter(const vec3& center, double halfSize, int i) {
+		double h = halfSize / 2;
+		return center + vec3((i & 1) ? h : -h, (i & 2) ? h : -h, (i & 4) ? h : -h);
+	}
+	static Node * child(Node * node, int i) {	// existing child or a new one
+		Node * c = node->children[i].load();
+		if (c) return c;
+		Node * created = new Node();
+		if (node->children[i].compare_exchange_strong(c, created)) return created;
+		delete created;	// another thread was faster
+		return c;
+	}
+	// store the record in the nodes of the level matching its size that overlap its sphere of influence
+	void insert(Node * node, const vec3& center, double halfSize, IrradianceRecord * record, double radius, int depth) {
+		if (halfSize < 2 * radius || depth == 16) {
+			RecordLink * link = new RecordLink;
+			link->record = record;
+			link->next = node->records.load();
+			while (!node->records.compare_exchange_weak(link->next, link));
+			return;
+		}
+		for (int i = 0; i < 8; i++) {
+			vec3 c = childCenter(center, halfSize, i);
+			double h = halfSize / 2;
+			const vec3& p = record->position;
+			if (fabs(p.x - c.x) <= h + radius && fabs(p.y - c.y) <= h + radius && fabs(p.z - c.z) <= h + radius)
+				insert(child(node, i), c, h, record, radius, depth + 1);
+		}
+	}
+public:
+	IrradianceCache() { root = NULL; nRecords = 0; }
+
+	void init(const vec3& boxMin, const vec3& boxMax) {
+		root = new Node();
+		rootCenter = (boxMin + boxMax) / 2;
+		vec3 size = boxMax - boxMin;
+		rootHalfSize = fmax(size.x, fmax(size.y, size.z)) / 2;
+		nRecords = 0;
+	}
+	bool isEnabled() { return root != NULL; }
+	int size() { return nRecords; }
+
+	void add(IrradianceRecord * record) {
+		insert(root, rootCenter, rootHalfSize, record, cacheError * record->R, 0);
+		nRecords++;
+	}
+
+	// Weighted average of the records valid at the point, false if there is none
+	bool interpolate(const vec3& position, const vec3& normal, vec3& E) {
+		vec3 sumE(0, 0, 0);
+		double sumWeight = 0;
+		Node * node = root;
+		vec3 center = rootCenter;
+		double halfSize = rootHalfSize;
+		while (node) {
+			for (RecordLink * link = node->records.load(); link; link = link->next) {
+				const IrradianceRecord& record = *link->record;
+				vec3 d = position - record.position;
+				if (dot(d, normal + record.normal) / 2 < -0.01) continue;	// record is in front of the point
+				double error = d.Length() / record.R + sqrt(fmax(0, 1 - dot(normal, record.normal)));
+				if (error >= cacheError) continue;
+				double weight = 1 / fmax(error, epsilon) - 1 / cacheError;	// falls to zero at the border, no seams
+				vec3 rotation = cross(record.normal, normal);
+				vec3 Ei = record.E
+					+ record.rotGradient[0] * rotation.x + record.rotGradient[1] * rotation.y + record.rotGradient[2] * rotation.z
+					+ record.transGradient[0] * d.x + record.transGradient[1] * d.y + record.transGradient[2] * d.z;
+				sumE += vec3(fmax(Ei.x, 0), fmax(Ei.y, 0), fmax(Ei.z, 0)) * weight;
+				sumWeight += weight;
+			}
+			int i = ((position.x > center.x) ? 1 : 0) + ((position.y > center.y) ? 2 : 0) + ((position.z > center.z) ? 4 : 0);
+			center = childCenter(center, halfSize, i);
+			halfSize /= 2;
+			node = node->children[i].load();
+		}
+		if (sumWeight <= 0) return false;
+		E = sumE / sumWeight;
+		return true;
+	}
+};
+
 // Virtual world
 class Scene {
 	int nObjects, nLights;
 	Intersectable * objects[nMaxObjects];
 	Light * lights[nMaxLights];
 	Camera camera;
+	PhotonMap causticMap;
+	bool useCaustics;
+	Integrator integrator;
+	PathGuide guide;
+	bool useGuiding, recordGuiding;
+	IrradianceCache irradianceCache;
+	std::vector<RenderStats> stats;		// one per thread, summed only when reported
+	std::vector<float> pixelCost;		// nanoseconds spent on the pixels by render() or the measured passes
+	unsigned int nStreams;				// random number streams handed out, one per parallel loop
 public:
-	Scene() { nObjects = nLights = 0; }
+	Scene() : stats(ThreadCount()) { nObjects = nLights = 0; useCaustics = false; integrator = PATH_TRACING; useGuiding = recordGuiding = false; nStreams = 0; }
+
+	void setIntegrator(Integrator _integrator) { integrator = _integrator; }
 
 	void build() {
 		vec3 eye = vec3(0, 0, 2);
@@ -230,18 +834,201 @@ public:
 			new Material(vec3(0.9, 0.4, 0.3), vec3(0.0, 0.0, 0.0)));
 	}
 
-	// Find the first intersection of the ray with objects
+	// Ray parameter of the first intersection and the intersected object (NULL if none)
+	double firstIntersectT(const Ray& ray, Intersectable ** bestObject = NULL) {
+		RenderStats& threadStats = stats[ThreadIndex()];
+		threadStats.count[RAYS]++;
+		threadStats.count[INTERSECTION_TESTS] += nObjects;
+		double bestT = -1;
+		Intersectable * best = NULL;
+		for (int iObject = 0; iObject < nObjects; iObject++) {
+			double t = objects[iObject]->intersectT(ray); //  t < 0 if no intersection
+			if (t > 0 && (bestT < 0 || t < bestT)) {
+				bestT = t;
+				best = objects[iObject];
+			}
+		}
+		if (bestObject) *bestObject = best;
+		return bestT;
+	}
+
+	// Find the first intersection of the ray with objects, surface attributes are only computed for the closest one
 	Hit firstIntersect(Ray ray) {
-		Hit bestHit;
+		Intersectable * best;
+		double t = firstIntersectT(ray, &best);
+		return best ? best->surface(ray, t) : Hit();
+	}
+
+	// Follow a photon through specular bounces, returns true and the landing photon if it reached a diffuse surface
+	bool tracePhoton(Ray ray, vec3 power, Photon& photon, Sampler& sampler) {
+		for (int depth = 0; depth < maxdepth; depth++) {
+			Hit hit = firstIntersect(ray);
+			if (hit.t < 0) return false;
+			if (depth > 0 && hit.material->diffuseAlbedo.average() > epsilon) {	// caustic: light, specular+, diffuse
+				photon.position = hit.position;
+				photon.dir = ray.dir;
+				photon.power = power;
+				return true;
+			}
+			double mirrorSelectProb = hit.material->mirrorAlbedo.average();
+			if (sampler.next() >= mirrorSelectProb) return false;	// Russian roulette
+			vec3 outDir;
+			double pdf = SampleMirror(hit.normal, ray.dir, outDir);
+			power = power * hit.material->mirrorAlbedo / pdf / mirrorSelectProb;
+			ray = Ray(hit.position + hit.normal * epsilon, outDir);
+		}
+		return false;
+	}
+
+	// Shoot photons from every light into the cones subtended by the specular objects and build the caustic map
+	void shootPhotons(int nPhotons) {
+		causticMap.clear();
+		std::vector<int> targets;
+		for (int iObject = 0; iObject < nObjects; iObject++) {
+			vec3 center;
+			double radius;
+			if (objects[iObject]->isSpecular() && objects[iObject]->bound(center, radius)) targets.push_back(iObject);
+		}
+		if (targets.empty()) return;
+		int nPerTarget = nPhotons / targets.size();
+
+		for (int iLight = 0; iLight < nLights; iLight++) {
+			vec3 source = lights[iLight]->location;
+			std::vector<vec3> axes(targets.size());
+			std::vector<double> cosMax(targets.size()), solidAngle(targets.size());
+			for (int t = 0; t < targets.size(); t++) {
+				vec3 center;
+				double radius;
+				objects[targets[t]]->bound(center, radius);
+				double distance = (center - source).Length();
+				axes[t] = (center - source).normalize();
+				cosMax[t] = (distance > radius) ? sqrt(1 - radius * radius / distance / distance) : -1;
+				solidAngle[t] = 2 * M_PI * (1 - cosMax[t]);
+			}
+
+			std::vector<Photon> shot(nPerTarget * targets.size());
+			std::vector<char> landed(shot.size(), 0);
+			unsigned int stream = nStreams++;
+#pragma omp parallel
+			{
+				Sampler sampler(stream, ThreadIndex());
+#pragma omp for schedule(static)
+				for (int i = 0; i < (int)shot.size(); i++) {
+					int t = i / nPerTarget;
+					vec3 w = axes[t];	// sample the cone uniformly around its axis
+					vec3 u = cross(w, vec3(1, 0, 0));
+					if (u.Length() < epsilon) u = cross(w, vec3(0, 0, 1));
+					u = u.normalize();
+					vec3 v = cross(w, u);
+					double cosTheta = 1 - sampler.next() * (1 - cosMax[t]);
+					double sinTheta = sqrt(fmax(0, 1 - cosTheta * cosTheta));
+					double phi = 2 * M_PI * sampler.next();
+					vec3 dir = w * cosTheta + u * (sinTheta * cos(phi)) + v * (sinTheta * sin(phi));
+
+					double pdf = nPerTarget / solidAngle[t];	// cones may overlap: combine the pdfs of all cones containing the direction
+					for (int k = 0; k < targets.size(); k++) {
+						if (k != t && dot(dir, axes[k]) >= cosMax[k]) pdf += nPerTarget / solidAngle[k];
+					}
+					vec3 power = lights[iLight]->power / (4 * M_PI) / pdf;
+					landed[i] = tracePhoton(Ray(source, dir), power, shot[i], sampler);
+				}
+			}
+
+			std::vector<Photon> stored;
+			for (int i = 0; i < shot.size(); i++) if (landed[i]) stored.push_back(shot[i]);
+			causticMap.store(stored);
+		}
+		causticMap.build();
+		useCaustics = true;
+		printf("%d caustic photons stored\n", causticMap.size());
+	}
+
+	// Bounding box of the bounded objects, which enclose the scene
+	void bounds(vec3& boxMin, vec3& boxMax) {
+		boxMin = vec3(1e10, 1e10, 1e10);
+		boxMax = vec3(-1e10, -1e10, -1e10);
 		for (int iObject = 0; iObject < nObjects; iObject++) {
-			Hit hit = objects[iObject]->intersect(ray); //  hit.t < 0 if no intersection
-			if (hit.t > 0 && (bestHit.t < 0 || hit.t < bestHit.t)) bestHit = hit;
+			vec3 center;
+			double radius;
+			if (!objects[iObject]->bound(center, radius)) continue;
+			boxMin = vec3(fmin(boxMin.x, center.x - radius), fmin(boxMin.y, center.y - radius), fmin(boxMin.z, center.z - radius));
+			boxMax = vec3(fmax(boxMax.x, center.x + radius), fmax(boxMax.y, center.y + radius), fmax(boxMax.z, center.z + radius));
+		}
+	}
+
+	// New irradiance record from stratified cosine distributed rays, the gradients are Ward and Heckbert's
+	IrradianceRecord * computeIrradianceRecord(const vec3& position, const vec3& N, Sampler& sampler, int depth) {
+		const int M = nCacheThetaStrata, Nphi = nCachePhiStrata;
+		vec3 T = cross(N, vec3(1, 0, 0));
+		if (T.Length() < epsilon) T = cross(N, vec3(0, 0, 1));
+		T = T.normalize();
+		vec3 B = cross(N, T);
+
+		static thread_local std::vector<vec3> L;	// radiance and hit distance of the strata
+		static thread_local std::vector<double> r;
+		L.resize(M * Nphi);
+		r.resize(M * Nphi);
+		IrradianceRecord * record = new IrradianceRecord;
+		record->position = position;
+		record->normal = N;
+		record->E = vec3(0, 0, 0);
+		for (int axis = 0; axis < 3; axis++) record->rotGradient[axis] = record->transGradient[axis] = vec3(0, 0, 0);
+		double invDistances = 0;
+		for (int j = 0; j < M; j++) {
+			for (int k = 0; k < Nphi; k++) {
+				double sinTheta = sqrt((j + sampler.next()) / M), phi = 2 * M_PI * (k + sampler.next()) / Nphi;
+				double cosTheta = sqrt(fmax(0, 1 - sinTheta * sinTheta));
+				vec3 dir = T * (sinTheta * cos(phi)) + B * (sinTheta * sin(phi)) + N * cosTheta;
+				Ray ray(position + N * epsilon, dir);
+				double t = firstIntersectT(ray);
+				r[j * Nphi + k] = (t > 0) ? t : 1e10;
+				L[j * Nphi + k] = trace(ray, sampler, depth + 1, true);
+				record->E += L[j * Nphi + k] * (M_PI / (M * Nphi));
+				invDistances += 1 / r[j * Nphi + k];
+				vec3 v = B * cos(phi) - T * sin(phi);	// rotational gradient: -tan theta weighted
+				vec3 rot = v * (-sinTheta / fmax(cosTheta, epsilon) * M_PI / (M * Nphi));
+				record->rotGradient[0] += L[j * Nphi + k] * rot.x;
+				record->rotGradient[1] += L[j * Nphi + k] * rot.y;
+				record->rotGradient[2] += L[j * Nphi + k] * rot.z;
+			}
+		}
+		for (int k = 0; k < Nphi; k++) {	// translational gradient from the differences of neighbouring strata
+			double phiCenter = 2 * M_PI * (k + 0.5) / Nphi, phiMinus = 2 * M_PI * k / Nphi;
+			vec3 u = T * cos(phiCenter) + B * sin(phiCenter);
+			vec3 vMinus = B * cos(phiMinus) - T * sin(phiMinus);
+			int kPrev = (k + Nphi - 1) % Nphi;
+			for (int j = 0; j < M; j++) {
+				double sinMinus = sqrt((double)j / M), cosMinus = sqrt(1 - (double)j / M), cosPlus = sqrt(1 - (double)(j + 1) / M);
+				vec3 grad(0, 0, 0);
+				if (j > 0) {
+					vec3 dL = L[j * Nphi + k] - L[(j - 1) * Nphi + k];
+					double w = 2 * M_PI / Nphi * sinMinus * cosMinus * cosMinus / fmin(r[j * Nphi + k], r[(j - 1) * Nphi + k]);
+					record->transGradient[0] += dL * (u.x * w);
+					record->transGradient[1] += dL * (u.y * w);
+					record->transGradient[2] += dL * (u.z * w);
+				}
+				vec3 dL = L[j * Nphi + k] - L[j * Nphi + kPrev];
+				double w = (cosMinus - cosPlus) / (sqrt((j + 0.5) / M) * fmin(r[j * Nphi + k], r[j * Nphi + kPrev]));
+				record->transGradient[0] += dL * (vMinus.x * w);
+				record->transGradient[1] += dL * (vMinus.y * w);
+				record->transGradient[2] += dL * (vMinus.z * w);
+			}
 		}
-		return bestHit;
+		record->R = fmin(fmax(M * Nphi / invDistances, minCacheSpacing), maxCacheSpacing);
+		return record;
+	}
+
+	// Irradiance from the cache, computes and adds a new record if no record is close enough
+	vec3 cachedIrradiance(const vec3& position, const vec3& N, Sampler& sampler, int depth) {
+		vec3 E;
+		if (irradianceCache.interpolate(position, N, E)) return E;
+		IrradianceRecord * record = computeIrradianceRecord(position, N, sampler, depth);
+		irradianceCache.add(record);
+		return record->E;
 	}
 
 	// Trace a ray and return the radiance of the visible surface
-	vec3 trace(Ray ray, int depth = 0) {
+	vec3 trace(Ray ray, Sampler& sampler, int depth = 0, bool diffusePath = false) {
 		Hit hit = firstIntersect(ray);	// Find visible surface
 		vec3 outRad(0, 0, 0);
 		if (hit.t < 0 || depth >= maxdepth) return outRad;	// If there is no intersection
@@ -250,49 +1037,397 @@ public:
 		vec3 outDir;
 		for (int iLight = 0; iLight < nLights; iLight++) {	// Direct light source computation
 			outDir = lights[iLight]->directionOf(hit.position);
-			Hit shadowHit = firstIntersect(Ray(hit.position + N * epsilon, outDir));
-			if (shadowHit.t < epsilon || shadowHit.t > lights[iLight]->distanceOf(hit.position)) {	// if not in shadow
+			stats[ThreadIndex()].count[SHADOW_RAYS]++;
+			double shadowT = firstIntersectT(Ray(hit.position + N * epsilon, outDir));
+			if (shadowT < epsilon || shadowT > lights[iLight]->distanceOf(hit.position)) {	// if not in shadow
 				double cosThetaL = dot(N, outDir);
 				if (cosThetaL >= epsilon) {
 					outRad += hit.material->diffuseAlbedo / M_PI * cosThetaL * lights[iLight]->radianceAt(hit.position);
 				}
 			}
 		}
+		// caustics cannot be found by the random walk, gathered where seen directly or via mirrors (indirect ones would just add noise)
+		if (useCaustics && !diffusePath && hit.material->diffuseAlbedo.average() > epsilon) {
+			outRad += causticMap.radianceEstimate(hit.position, N, hit.material->diffuseAlbedo);
+		}
 
 		double diffuseSelectProb = hit.material->diffuseAlbedo.average();
 		double mirrorSelectProb = hit.material->mirrorAlbedo.average();
+		// the smooth indirect light of the first diffuse surface is interpolated from the irradiance cache
+		if (irradianceCache.isEnabled() && !diffusePath && diffuseSelectProb > epsilon) {
+			outRad += hit.material->diffuseAlbedo / M_PI * cachedIrradiance(hit.position, N, sampler, depth);
+			diffuseSelectProb = 0;
+		}
 
-		double rnd = random();	// Russian roulette to find diffuse, mirror or no reflection
+		double rnd = sampler.next();	// Russian roulette to find diffuse, mirror or no reflection
 		if (rnd < diffuseSelectProb) { // diffuse
-			double pdf = SampleDiffuse(N, ray.dir, outDir);
+			double pdf = useGuiding ? guide.sample(hit.position, N, ray.dir, outDir, sampler) : SampleDiffuse(N, ray.dir, outDir, sampler);
 			double cosThetaL = dot(N, outDir);
 			if (cosThetaL >= epsilon) {
-				outRad += trace(Ray(hit.position + N * epsilon, outDir), depth + 1) * hit.material->diffuseAlbedo / M_PI * cosThetaL / pdf / diffuseSelectProb;
+				stats[ThreadIndex()].count[BOUNCES]++;
+				vec3 inRad = trace(Ray(hit.position + N * epsilon, outDir), sampler, depth + 1, true);
+				if (recordGuiding) guide.record(hit.position, outDir, inRad.average() / pdf);
+				outRad += inRad * hit.material->diffuseAlbedo / M_PI * cosThetaL / pdf / diffuseSelectProb;
 			}
 		}
 		else if (rnd < diffuseSelectProb + mirrorSelectProb) { // mirror
 			double pdf = SampleMirror(N, ray.dir, outDir);
-			outRad += trace(Ray(hit.position + N * epsilon, outDir), depth + 1) * hit.material->mirrorAlbedo / pdf / mirrorSelectProb;
+			stats[ThreadIndex()].count[BOUNCES]++;
+			outRad += trace(Ray(hit.position + N * epsilon, outDir), sampler, depth + 1, diffusePath) * hit.material->mirrorAlbedo / pdf / mirrorSelectProb;
+		}
+		else stats[ThreadIndex()].count[ROULETTE_TERMINATIONS]++;
+		return outRad;
+	}
+
+	// Extend a subpath from path[0] with the random walk of trace(), returns the number of vertices
+	int randomWalk(Ray ray, vec3 beta, double pdfDir, PathVertex path[], int maxVertices, Sampler& sampler) {
+		int nVertices = 1;
+		while (nVertices < maxVertices) {
+			Hit hit = firstIntersect(ray);
+			if (hit.t < 0) break;
+			PathVertex& vertex = path[nVertices];
+			PathVertex& prev = path[nVertices - 1];
+			vertex = PathVertex();
+			vertex.position = hit.position;
+			vertex.normal = hit.normal;
+			vertex.material = hit.material;
+			vertex.beta = beta;
+			vertex.pdfFwd = ConvertDensity(pdfDir, prev, vertex);
+			nVertices++;
+
+			vec3 N = hit.normal, outDir;
+			double pdfRevDir;
+			double diffuseSelectProb = hit.material->diffuseAlbedo.average();
+			double mirrorSelectProb = hit.material->mirrorAlbedo.average();
+			double rnd = sampler.next();	// Russian roulette to find diffuse, mirror or no reflection
+			if (rnd < diffuseSelectProb) {
+				pdfDir = SampleDiffuse(N, ray.dir, outDir, sampler) * diffuseSelectProb;
+				double cosThetaL = dot(N, outDir);
+				if (cosThetaL < epsilon) break;
+				beta = beta * hit.material->diffuseAlbedo / M_PI * cosThetaL / pdfDir;
+				pdfRevDir = DiffuseDirectionPdf(vertex, -ray.dir);
+			}
+			else if (rnd < diffuseSelectProb + mirrorSelectProb) {
+				SampleMirror(N, ray.dir, outDir);
+				beta = beta * hit.material->mirrorAlbedo / mirrorSelectProb;
+				vertex.delta = true;
+				pdfDir = pdfRevDir = 0;
+			}
+			else {
+				stats[ThreadIndex()].count[ROULETTE_TERMINATIONS]++;
+				break;
+			}
+			stats[ThreadIndex()].count[BOUNCES]++;
+			prev.pdfRev = ConvertDensity(pdfRevDir, vertex, prev);
+			ray = Ray(hit.position + N * epsilon, outDir);
+		}
+		return nVertices;
+	}
+
+	// Is the segment between two vertices free of occluders
+	bool visible(const PathVertex& v1, const PathVertex& v2) {
+		vec3 start = v1.isSurface() ? v1.position + v1.normal * epsilon : v1.position;
+		vec3 dir = v2.position - start;
+		double distance = dir.Length();
+		stats[ThreadIndex()].count[SHADOW_RAYS]++;
+		double shadowT = firstIntersectT(Ray(start, dir));
+		return shadowT < epsilon || shadowT > distance - 2 * epsilon;
+	}
+
+	// Multiple importance sampling weight (balance heuristic) of connecting light vertex s-1 to camera vertex t-1,
+	// the strategies are the other ways of splitting the same path, except light tracing (t = 1) that is not implemented
+	double misWeight(const PathVertex lightPath[], const PathVertex cameraPath[], int s, int t) {
+		if (s + t == 2) return 1;
+		PathVertex lightVertices[maxdepth + 2], cameraVertices[maxdepth + 2];	// copies with the densities of the connection
+		for (int i = 0; i < s; i++) lightVertices[i] = lightPath[i];
+		for (int i = 0; i < t; i++) cameraVertices[i] = cameraPath[i];
+		PathVertex& qs = lightVertices[s - 1];
+		PathVertex& pt = cameraVertices[t - 1];
+		vec3 toLight = (qs.position - pt.position).normalize();
+
+		if (s == 1) pt.pdfRev = ConvertDensity(1 / (4 * M_PI), qs, pt);	// emission from the point light
+		else pt.pdfRev = ConvertDensity(DiffuseDirectionPdf(qs, -toLight), qs, pt);
+		cameraVertices[t - 2].pdfRev = ConvertDensity(DiffuseDirectionPdf(pt, (cameraVertices[t - 2].position - pt.position).normalize()), pt, cameraVertices[t - 2]);
+		qs.pdfRev = (s == 1) ? 0 : ConvertDensity(DiffuseDirectionPdf(pt, toLight), pt, qs);	// point light cannot be hit
+		if (s > 1) lightVertices[s - 2].pdfRev = ConvertDensity(DiffuseDirectionPdf(qs, (lightVertices[s - 2].position - qs.position).normalize()), qs, lightVertices[s - 2]);
+		qs.delta = pt.delta = false;
+
+		double sumRi = 0, ri = 1;
+		for (int i = t - 1; i > 0; i--) {	// camera vertex i would be sampled from the light side
+			ri *= remap0(cameraVertices[i].pdfRev) / remap0(cameraVertices[i].pdfFwd);
+			if (i > 1 && !cameraVertices[i].delta && !cameraVertices[i - 1].delta) sumRi += ri;
+		}
+		ri = 1;
+		for (int i = s - 1; i > 0; i--) {	// light vertex i would be sampled from the camera side, the point light never
+			ri *= remap0(lightVertices[i].pdfRev) / remap0(lightVertices[i].pdfFwd);
+			if (!lightVertices[i].delta && !lightVertices[i - 1].delta) sumRi += ri;
+		}
+		return 1 / (1 + sumRi);
+	}
+
+	// Bidirectional path tracing: connect every vertex of a light subpath with every vertex of a camera subpath
+	vec3 traceBidirectional(Ray ray, Sampler& sampler) {
+		PathVertex cameraPath[maxdepth + 2], lightPath[maxdepth + 2];
+		cameraPath[0].position = ray.start;
+		cameraPath[0].beta = vec3(1, 1, 1);
+		int nCamera = randomWalk(ray, vec3(1, 1, 1), 1, cameraPath, maxdepth + 1, sampler);	// pinhole density is only needed by light tracing
+
+		Light * light = lights[(int)(sampler.next() * nLights) % nLights];	// select a light uniformly
+		lightPath[0].position = light->location;
+		lightPath[0].beta = light->power / (4 * M_PI) * nLights;		// intensity / selection probability
+		lightPath[0].pdfFwd = 1.0 / nLights;
+		double z = 2 * sampler.next() - 1, phi = 2 * M_PI * sampler.next();	// uniform emission direction
+		vec3 emitDir(sqrt(1 - z * z) * cos(phi), sqrt(1 - z * z) * sin(phi), z);
+		int nLight = randomWalk(Ray(light->location, emitDir), lightPath[0].beta * (4 * M_PI), 1 / (4 * M_PI), lightPath, maxdepth + 1, sampler);
+
+		vec3 outRad(0, 0, 0);
+		for (int t = 2; t <= nCamera; t++) {
+			for (int s = 1; s <= nLight; s++) {
+				if (s + t - 2 > maxdepth) break;
+				const PathVertex& qs = lightPath[s - 1];
+				const PathVertex& pt = cameraPath[t - 1];
+				if (!qs.isConnectible() || !pt.isConnectible()) continue;
+				vec3 w = qs.position - pt.position;
+				double distance2 = dot(w, w);
+				w = w / sqrt(distance2);
+				double cosThetaC = dot(pt.normal, w);
+				double cosThetaL = qs.isSurface() ? dot(qs.normal, -w) : 1;
+				if (cosThetaC < epsilon || cosThetaL < epsilon) continue;
+				vec3 L = pt.beta * pt.material->diffuseAlbedo / M_PI * qs.beta * (cosThetaC * cosThetaL / distance2);
+				if (qs.isSurface()) L = L * qs.material->diffuseAlbedo / M_PI;
+				if (L.average() == 0 || !visible(pt, qs)) continue;
+				outRad += L * misWeight(lightPath, cameraPath, s, t);
+			}
 		}
 		return outRad;
 	}
 
+	// Path of the primary sample vector: the first two numbers select the point on the image
+	vec3 metropolisPath(Sampler& sampler, int& pixel) {
+		double X = sampler.next() * screenWidth, Y = sampler.next() * screenHeight;
+		pixel = std::min((int)Y, (int)screenHeight - 1) * screenWidth + std::min((int)X, (int)screenWidth - 1);
+		stats[ThreadIndex()].count[CAMERA_SAMPLES]++;
+		return trace(camera.getRay(X, Y), sampler);
+	}
+
+	// Primary sample space Metropolis light transport: independent Markov chains on the threads splat into their own
+	// images, these are merged at the end; the total number of mutations is the same as the samples of render()
+	void renderMetropolis(vec3 image[]) {
+		TRACE_SCOPE("Scene::renderMetropolis");
+		int nPixels = screenWidth * screenHeight;
+		double b = 0;	// normalization: average luminance of independent paths
+		Sampler sampler(nStreams++);
+		for (int i = 0; i < nBootstrap; i++) {
+			int pixel;
+			b += metropolisPath(sampler, pixel).average();
+		}
+		b /= nBootstrap;
+		printf("Metropolis normalization: %g\n", b);
+		if (b <= 0) {
+			for (int p = 0; p < nPixels; p++) image[p] = vec3(0, 0, 0);
+			return;
+		}
+
+		int nChains = ThreadCount();
+		long long nChainMutations = (long long)nSamples * nPixels / nChains;
+		std::vector<std::vector<vec3> > splats(nChains, std::vector<vec3>(nPixels));
+#pragma omp parallel for schedule(static, 1)
+		for (int chain = 0; chain < nChains; chain++) {
+			std::vector<vec3>& splat = splats[chain];
+			MetropolisSampler mlt(1234567 + chain * 7919);
+			int currentPixel;
+			vec3 currentL;
+			do {	// start from a path that carries light (large steps are independent samples)
+				mlt.startIteration(true);
+				currentL = metropolisPath(mlt, currentPixel);
+				if (currentL.average() > 0) mlt.accept(); else mlt.reject();
+			} while (currentL.average() <= 0);
+
+			for (long long m = 0; m < nChainMutations; m++) {
+				mlt.startIteration(mlt.random01() < largeStepProb);
+				int proposedPixel;
+				vec3 proposedL = metropolisPath(mlt, proposedPixel);
+				double proposedI = proposedL.average(), currentI = currentL.average();
+				double accept = fmin(1, proposedI / currentI);
+				if (accept > 0) splat[proposedPixel] += proposedL * (accept / proposedI);	// expected values of both states
+				splat[currentPixel] += currentL * ((1 - accept) / currentI);
+				if (mlt.random01() < accept) {
+					mlt.accept();
+					currentL = proposedL;
+					currentPixel = proposedPixel;
+				}
+				else mlt.reject();
+				if (chain == 0 && m % (nChainMutations / 100 + 1) == 0) printf("%d%%\r", (int)(100 * m / nChainMutations));
+			}
+		}
+
+		double scale = b * nPixels / (double)(nChainMutations * nChains);	// b / mutations per pixel
+		for (int p = 0; p < nPixels; p++) {
+			image[p] = vec3(0, 0, 0);
+			for (int chain = 0; chain < nChains; chain++) image[p] += splats[chain][p] * scale;
+		}
+	}
+
+	// Train path guiding in iterations of doubling sample counts, the images of the iterations are dropped
+	void trainGuiding() {
+		vec3 boxMin, boxMax;
+		bounds(boxMin, boxMax);
+		guide.init(boxMin, boxMax);
+		useGuiding = recordGuiding = true;
+		vec3 * image = new vec3[screenWidth * screenHeight];
+		for (int iteration = 0; iteration < nGuidingIterations; iteration++) {
+			int spp = 1 << iteration;
+			auto start = std::chrono::steady_clock::now();
+			for (int i = 0; i < spp; i++) renderPass(image);
+			auto rendered = std::chrono::steady_clock::now();
+			guide.update();
+			auto updated = std::chrono::steady_clock::now();
+			printf("guiding iteration %d: %d spp, render %.2f sec, update %.3f sec\n", iteration, spp,
+				std::chrono::duration<double>(rendered - start).count(), std::chrono::duration<double>(updated - rendered).count());
+		}
+		recordGuiding = false;
+		delete[] image;
+	}
+
+	// Create the irradiance cache and fill it on coarse to fine pixel grids, so that the records of the final pass
+	// overlap and new records are rarely computed next to already shaded pixels
+	void enableIrradianceCache() {
+		vec3 boxMin, boxMax;
+		bounds(boxMin, boxMax);
+		irradianceCache.init(boxMin, boxMax);
+		unsigned int stream = nStreams++;
+#pragma omp parallel
+		{
+			Sampler sampler(stream, ThreadIndex());
+			for (int step = 16; step >= 2; step /= 2) {
+				for (int Y = step / 2; Y < screenHeight; Y += step) {
+#pragma omp for schedule(static)
+					for (int X = step / 2; X < screenWidth; X += step) trace(camera.getRay(X, Y), sampler);
+				}
+			}
+		}
+		printf("%d irradiance records in the pre-pass\n", irradianceCache.size());
+	}
+	int irradianceRecords() { return irradianceCache.size(); }
+
+	// Radiance arriving along a camera ray with the selected integrator
+	vec3 sample(Ray ray, Sampler& sampler) {
+		stats[ThreadIndex()].count[CAMERA_SAMPLES]++;
+		return (integrator == BIDIRECTIONAL) ? traceBidirectional(ray, sampler) : trace(ray, sampler);
+	}
+
+	// Add one sample to every pixel, image holds the sum of samples; measured passes add their time to pixelCost
+	void renderPass(vec3 image[], bool measureCost = false) {
+		TRACE_SCOPE("Scene::renderPass");
+		if (measureCost && pixelCost.size() != screenWidth * screenHeight) pixelCost.assign(screenWidth * screenHeight, 0);
+		unsigned int stream = nStreams++;
+#pragma omp parallel
+		{
+			Sampler sampler(stream, ThreadIndex());
+			for (int Y = 0; Y < screenHeight; Y++) {
+#pragma omp for schedule(static)
+				for (int X = 0; X < screenWidth; X++) {
+					auto start = std::chrono::steady_clock::now();
+					image[Y * screenWidth + X] += sample(camera.getRay(X + sampler.next(), Y + sampler.next()), sampler);
+					if (measureCost) pixelCost[Y * screenWidth + X] += (float)std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+				}
+			}
+		}
+	}
+
+	// Render the pixels of a tile into RGB floats
+	void renderTile(const Tile& tile, float result[]) {
+		TRACE_SCOPE("Scene::renderTile");
+		unsigned int stream = 0x80000000u + tile.y0 * screenWidth + tile.x0;	// the tile selects it, not the worker
+#pragma omp parallel
+		{
+			Sampler sampler(stream, ThreadIndex());
+			for (int y = 0; y < tile.height; y++) {
+#pragma omp for schedule(static)
+				for (int x = 0; x < tile.width; x++) {
+					int X = tile.x0 + x, Y = tile.y0 + y;
+					vec3 radiance(0, 0, 0);
+					for (int i = 0; i < nSamples; i++) radiance += sample(camera.getRay(X + sampler.next(), Y + sampler.next()), sampler) / nSamples;
+					float * pixel = &result[(y * tile.width + x) * 3];
+					pixel[0] = (float)radiance.x; pixel[1] = (float)radiance.y; pixel[2] = (float)radiance.z;
+				}
+			}
+		}
+	}
+	// Samples belong to pixels, so the image can be split into tiles or passes (Metropolis splats anywhere)
+	bool hasPixelSamples() { return integrator != METROPOLIS; }
+
 	// Render the scene: Trace nSamples rays through each pixel and average radiance values
 	void render(vec3 image[]) {
-		for (int Y = 0; Y < screenHeight; Y++) {
-			printf("%d\r", Y);
-#pragma omp parallel for
-			for (int X = 0; X < screenWidth; X++) {
-				image[Y * screenWidth + X] = vec3(0, 0, 0);
-				for (int i = 0; i < nSamples; i++)
-					image[Y * screenWidth + X] += trace(camera.getRay(X + random(), Y + random())) / nSamples;
+		TRACE_SCOPE("Scene::render");
+		if (integrator == METROPOLIS) {
+			renderMetropolis(image);
+			return;
+		}
+		pixelCost.resize(screenWidth * screenHeight);
+		unsigned int stream = nStreams++;
+#pragma omp parallel
+		{
+			Sampler sampler(stream, ThreadIndex());
+			for (int Y = 0; Y < screenHeight; Y++) {
+				if (ThreadIndex() == 0) printf("%d\r", Y);
+#pragma omp for schedule(static)
+				for (int X = 0; X < screenWidth; X++) {
+					auto start = std::chrono::steady_clock::now();
+					image[Y * screenWidth + X] = vec3(0, 0, 0);
+					for (int i = 0; i < nSamples; i++)
+						image[Y * screenWidth + X] += sample(camera.getRay(X + sampler.next(), Y + sampler.next()), sampler) / nSamples;
+					pixelCost[Y * screenWidth + X] = (float)std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+				}
 			}
 		}
 	}
+
+	// Sum of the counters of the threads, the pre-passes included
+	void printStats() {
+		const char * names[nCounters] = { "camera samples", "rays", "intersection tests", "shadow rays", "bounces", "roulette terminations" };
+		long long total[nCounters];
+		for (int c = 0; c < nCounters; c++) {
+			total[c] = 0;
+			for (int t = 0; t < stats.size(); t++) total[c] += stats[t].count[c];
+		}
+		double nCameraSamples = (double)std::max(total[CAMERA_SAMPLES], 1LL);
+		printf("%-22s %14lld\n", names[CAMERA_SAMPLES], total[CAMERA_SAMPLES]);
+		for (int c = CAMERA_SAMPLES + 1; c < nCounters; c++)
+			printf("%-22s %14lld  (%.2f per camera sample)\n", names[c], total[c], total[c] / nCameraSamples);
+	}
+
+	// Heat map of the time spent on the pixels from blue (cheap) through green to red (the 99th percentile and above)
+	bool costImage(vec3 image[]) {
+		if (pixelCost.empty()) return false;
+		std::vector<float> sorted = pixelCost;	// the maximum is an outlier when the thread was preempted
+		std::nth_element(sorted.begin(), sorted.begin() + sorted.size() * 99 / 100, sorted.end());
+		double highCost = sorted[sorted.size() * 99 / 100], sumCost = 0;
+		for (int p = 0; p < pixelCost.size(); p++) sumCost += pixelCost[p];
+		printf("pixel cost: average %.0f ns, 99th percentile %.0f ns\n", sumCost / pixelCost.size(), highCost);
+		for (int p = 0; p < pixelCost.size(); p++) {
+			double t = (highCost > 0) ? fmin(pixelCost[p] / highCost, 1) : 0;
+			image[p] = vec3(fmax(2 * t - 1, 0), 1 - fabs(2 * t - 1), fmax(1 - 2 * t, 0));
+		}
+		return true;
+	}
+
+	// The raw nanoseconds of the pixels as a greyscale PFM (bottom row first, negative scale for little endian)
+	void saveCost(const char * fileName) {
+		FILE * file = fopen(fileName, "wb");
+		if (!file) {
+			printf("File %s cannot be opened\n", fileName);
+			return;
+		}
+		const unsigned short one = 1;
+		fprintf(file, "Pf\n%d %d\n%s\n", screenWidth, screenHeight, *(const char *)&one ? "-1.0" : "1.0");
+		fwrite(&pixelCost[0], sizeof(float), pixelCost.size(), file);	// row 0 is the bottom one
+		fclose(file);
+	}
 };
 
 // Save image into a Targa format file
-void SaveTGAFile(char * fileName, vec3 image[]) {
+void SaveTGAFile(const char * fileName, vec3 image[]) {
 	FILE * tgaFile = fopen(fileName, "wb");
 	if (!tgaFile) {
 		printf("File %s cannot be opened\n", fileName);
@@ -316,11 +1451,391 @@ void SaveTGAFile(char * fileName, vec3 image[]) {
 	fclose(tgaFile);
 }
 
+// Render whole-image sample passes until the time budget is spent; a pass is only started if it is expected to finish
+// in time (at least one pass is always rendered). If intermediateFile is given, the average is saved after every pass.
+// Returns the achieved samples per pixel.
+int RenderProgressive(Scene& scene, vec3 image[], double seconds, const char * intermediateFile = NULL) {
+	int nPixels = screenWidth * screenHeight;
+	vec3 * sum = new vec3[nPixels];
+	for (int p = 0; p < nPixels; p++) sum[p] = vec3(0, 0, 0);
+	auto start = std::chrono::steady_clock::now();
+	int nPasses = 0;
+	double elapsed = 0, passTime = 0;
+	while (nPasses == 0 || elapsed + passTime <= seconds) {
+		scene.renderPass(sum, true);
+		nPasses++;
+		double now = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		passTime = fmax(passTime, now - elapsed);	// the slowest pass so far predicts the next one
+		elapsed = now;
+		if (intermediateFile) {
+			for (int p = 0; p < nPixels; p++) image[p] = sum[p] / nPasses;
+			SaveTGAFile(intermediateFile, image);
+		}
+		printf("%d samples per pixel, %.1f sec\r", nPasses, elapsed);
+	}
+	printf("\n");
+	for (int p = 0; p < nPixels; p++) image[p] = sum[p] / nPasses;
+	delete[] sum;
+	return nPasses;
+}
+
+// Render the scene with both integrators for the same wall-clock time and save the images
+void CompareIntegrators(Scene& scene, double seconds) {
+	const Integrator integrators[] = { PATH_TRACING, BIDIRECTIONAL };
+	const char * names[] = { "path", "bdpt" };
+	vec3 * image = new vec3[screenWidth * screenHeight];
+	for (int i = 0; i < 2; i++) {
+		scene.setIntegrator(integrators[i]);
+		auto start = std::chrono::steady_clock::now();
+		int spp = RenderProgressive(scene, image, seconds);
+		double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		char fileName[256];
+		sprintf(fileName, "%s.tga", names[i]);
+		SaveTGAFile(fileName, image);
+		printf("%s: %d samples per pixel in %.1f sec -> %s\n", names[i], spp, elapsed, fileName);
+	}
+	delete[] image;
+}
+
+#if !defined(_WIN32)
+// Send or receive the whole buffer, false if the peer is gone
+bool SendAll(int socket, const void * data, size_t size) {
+	const char * p = (const char *)data;
+	while (size > 0) {
+		ssize_t n = send(socket, p, size, 0);
+		if (n <= 0) return false;
+		p += n; size -= n;
+	}
+	return true;
+}
+bool ReceiveAll(int socket, void * data, size_t size) {
+	char * p = (char *)data;
+	while (size > 0) {
+		ssize_t n = recv(socket, p, size, 0);
+		if (n <= 0) return false;
+		p += n; size -= n;
+	}
+	return true;
+}
+
+// Tiles and pixels travel as 32 bit words in network byte order, so the nodes may differ in endianness
+bool SendTile(int socket, const Tile& tile) {
+	uint32_t words[4] = { htonl(tile.x0), htonl(tile.y0), htonl(tile.width), htonl(tile.height) };
+	return SendAll(socket, words, sizeof(words));
+}
+bool ReceiveTile(int socket, Tile& tile) {
+	uint32_t words[4];
+	if (!ReceiveAll(socket, words, sizeof(words))) return false;
+	tile.x0 = (int)ntohl(words[0]); tile.y0 = (int)ntohl(words[1]);
+	tile.width = (int)ntohl(words[2]); tile.height = (int)ntohl(words[3]);
+	return tile.width > 0 && tile.height > 0 && tile.width <= tileSize && tile.height <= tileSize;
+}
+bool SendFloats(int socket, const std::vector<float>& values) {
+	std::vector<uint32_t> words(values.size());
+	for (size_t i = 0; i < values.size(); i++) {
+		memcpy(&words[i], &values[i], sizeof(float));
+		words[i] = htonl(words[i]);
+	}
+	return SendAll(socket, &words[0], words.size() * sizeof(uint32_t));
+}
+bool ReceiveFloats(int socket, std::vector<float>& values) {
+	std::vector<uint32_t> words(values.size());
+	if (!ReceiveAll(socket, &words[0], words.size() * sizeof(uint32_t))) return false;
+	for (size_t i = 0; i < values.size(); i++) {
+		words[i] = ntohl(words[i]);
+		memcpy(&values[i], &words[i], sizeof(float));
+	}
+	return true;
+}
+
+// Worker of distributed rendering: render the tiles sent by the coordinator until it closes the connection
+int RunWorker(Scene& scene, const char * host, int port) {
+	addrinfo hints, * address;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	char service[16];
+	sprintf(service, "%d", port);
+	if (getaddrinfo(host, service, &hints, &address) != 0) {
+		printf("Unknown coordinator %s\n", host);
+		return 1;
+	}
+	int coordinator = socket(AF_INET, SOCK_STREAM, 0);
+	if (coordinator < 0 || connect(coordinator, address->ai_addr, address->ai_addrlen) != 0) {
+		printf("Cannot connect to coordinator %s:%d\n", host, port);
+		freeaddrinfo(address);
+		return 1;
+	}
+	freeaddrinfo(address);
+	std::vector<float> result;
+	Tile tile;
+	while (ReceiveTile(coordinator, tile)) {
+		result.resize(tile.width * tile.height * 3);
+		scene.renderTile(tile, &result[0]);
+		if (!SendTile(coordinator, tile) || !SendFloats(coordinator, result)) break;
+	}
+	close(coordinator);
+	return 0;
+}
+
+// Merge the float result of a tile into the image
+void MergeTile(const Tile& tile, const std::vector<float>& result, vec3 image[]) {
+	for (int y = 0; y < tile.height; y++) {
+		for (int x = 0; x < tile.width; x++) {
+			const float * pixel = &result[(y * tile.width + x) * 3];
+			image[(tile.y0 + y) * screenWidth + tile.x0 + x] = vec3(pixel[0], pixel[1], pixel[2]);
+		}
+	}
+}
+
+// Coordinator of distributed rendering: hands out tiles to the workers connecting on the port, which are started
+// locally (nLocalWorkers) or on other machines with -worker. Tiles of workers that die or get stuck are handed out
+// again, and without any worker the coordinator renders the tiles itself. Messages are read with a timeout, so a
+// worker that sends only a part of its tile cannot block the others for long.
+// Local workers are new processes of this program with the same options, as the OpenMP runtime of the pre-passes
+// would not survive a fork: -distribute n [port] is replaced by -worker 127.0.0.1 port.
+void RunCoordinator(Scene& scene, int nLocalWorkers, int port, int argc, char * argv[], vec3 image[]) {
+	signal(SIGPIPE, SIG_IGN);	// a dead worker must not kill the coordinator
+	int listener = socket(AF_INET, SOCK_STREAM, 0);
+	int on = 1;
+	setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+	sockaddr_in address;
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_addr.s_addr = htonl(INADDR_ANY);
+	address.sin_port = htons(port);
+	if (bind(listener, (sockaddr *)&address, sizeof(address)) != 0 || listen(listener, 64) != 0) {
+		printf("Cannot listen on port %d\n", port);
+		return;
+	}
+
+	char portString[16];
+	sprintf(portString, "%d", port);
+	std::vector<char *> workerArgs;
+	for (int i = 0; i < argc; i++) {
+		if (strcmp(argv[i], "-distribute") == 0 && i + 1 < argc) {
+			i++;
+			if (i + 1 < argc && atoi(argv[i + 1]) > 0) i++;
+			workerArgs.push_back((char *)"-worker");
+			workerArgs.push_back((char *)"127.0.0.1");
+			workerArgs.push_back(portString);
+		}
+		else if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc) i++;	// the trace file is the coordinator's
+		else workerArgs.push_back(argv[i]);
+	}
+	workerArgs.push_back(NULL);
+	std::vector<pid_t> children;
+	for (int i = 0; i < nLocalWorkers; i++) {
+		pid_t pid = fork();
+		if (pid == 0) {
+			execvp(workerArgs[0], &workerArgs[0]);
+			_exit(1);
+		}
+		if (pid > 0) children.push_back(pid);
+	}
+	if (nLocalWorkers == 0) printf("Waiting for workers on port %d (-worker host %d)\n", port, port);
+
+	std::vector<Tile> tiles;
+	for (int y = 0; y < screenHeight; y += tileSize) {
+		for (int x = 0; x < screenWidth; x += tileSize) {
+			Tile tile = { x, y, std::min(tileSize, (int)screenWidth - x), std::min(tileSize, (int)screenHeight - y) };
+			tiles.push_back(tile);
+		}
+	}
+	std::vector<int> queue;		// tiles waiting for a worker
+	for (int t = tiles.size() - 1; t >= 0; t--) queue.push_back(t);
+	std::vector<int> workers, assigned;	// sockets of the connected workers and their tiles (-1 if idle)
+	std::vector<std::chrono::steady_clock::time_point> assignedAt;
+	int nDone = 0;
+	double slowestTile = 0;		// sec
+	auto noWorkerSince = std::chrono::steady_clock::now();
+	std::vector<float> result;
+
+	while (nDone < tiles.size()) {
+		auto now = std::chrono::steady_clock::now();
+		for (int w = 0; w < workers.size(); w++) {	// keep every worker busy
+			if (assigned[w] >= 0 || queue.empty()) continue;
+			assigned[w] = queue.back();
+			assignedAt[w] = now;
+			queue.pop_back();
+			if (!SendTile(workers[w], tiles[assigned[w]])) {
+				queue.push_back(assigned[w]);
+				assigned[w] = -2;	// dead, removed below
+			}
+		}
+		bool renderedLocally = false;
+		if (!workers.empty()) noWorkerSince = now;
+		else if (!queue.empty() && std::chrono::duration<double>(now - noWorkerSince).count() > workerWaitTimeout) {
+			const Tile& tile = tiles[queue.back()];		// nobody to render it
+			queue.pop_back();
+			result.resize(tile.width * tile.height * 3);
+			scene.renderTile(tile, &result[0]);
+			MergeTile(tile, result, image);
+			nDone++;
+			printf("%d/%d tiles\r", nDone, (int)tiles.size());
+			renderedLocally = true;
+		}
+
+		std::vector<pollfd> fds(workers.size() + 1);
+		fds[0].fd = listener;
+		fds[0].events = POLLIN;
+		for (int w = 0; w < workers.size(); w++) {
+			fds[w + 1].fd = (assigned[w] == -2) ? -1 : workers[w];
+			fds[w + 1].events = POLLIN;
+		}
+		if (poll(&fds[0], fds.size(), renderedLocally ? 0 : 1000) < 0) continue;
+
+		now = std::chrono::steady_clock::now();
+		for (int w = 0; w < workers.size(); w++) {
+			if (assigned[w] == -2) continue;
+			bool readable = (fds[w + 1].revents & (POLLIN | POLLHUP | POLLERR)) != 0;
+			if (assigned[w] == -1) {	// an idle worker sends nothing, unless it is gone
+				if (readable) assigned[w] = -2;
+				continue;
+			}
+			double elapsed = std::chrono::duration<double>(now - assignedAt[w]).count();
+			if (readable) {
+				const Tile& tile = tiles[assigned[w]];
+				Tile received;
+				result.resize(tile.width * tile.height * 3);
+				if (ReceiveTile(workers[w], received) && received.x0 == tile.x0 && received.y0 == tile.y0 &&
+					ReceiveFloats(workers[w], result)) {
+					MergeTile(tile, result, image);
+					nDone++;
+					printf("%d/%d tiles\r", nDone, (int)tiles.size());
+					slowestTile = std::max(slowestTile, elapsed);
+					assigned[w] = -1;
+					continue;
+				}
+			}
+			else if (elapsed < std::max(minTileTimeout, 10 * slowestTile)) continue;	// the minimum until a tile is done
+			queue.push_back(assigned[w]);	// died or stuck: render it again on another worker
+			assigned[w] = -2;
+		}
+		for (int w = workers.size() - 1; w >= 0; w--) {
+			if (assigned[w] != -2) continue;
+			printf("worker %d lost\n", w);
+			close(workers[w]);
+			workers.erase(workers.begin() + w);
+			assigned.erase(assigned.begin() + w);
+			assignedAt.erase(assignedAt.begin() + w);
+		}
+
+		if (fds[0].revents & POLLIN) {		// new worker
+			int worker = accept(listener, NULL, NULL);
+			if (worker >= 0) {
+				setsockopt(worker, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+				timeval timeout = { messageTimeout, 0 };	// recv fails after this, and the worker is lost
+				setsockopt(worker, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+				workers.push_back(worker);
+				assigned.push_back(-1);
+				assignedAt.push_back(std::chrono::steady_clock::now());
+			}
+		}
+	}
+	printf("\n");
+	for (int w = 0; w < workers.size(); w++) close(workers[w]);	// workers stop when the connection closes
+	close(listener);
+	for (int i = 0; i < children.size(); i++) {
+		kill(children[i], SIGKILL);		// the image is complete, a stuck worker would not notice the closed connection
+		waitpid(children[i], NULL, 0);
+	}
+}
+#else
+int RunWorker(Scene& scene, const char * host, int port) {
+	printf("Distributed rendering needs POSIX sockets\n");
+	return 1;
+}
+void RunCoordinator(Scene& scene, int nLocalWorkers, int port, int argc, char * argv[], vec3 image[]) {
+	printf("Distributed rendering needs POSIX sockets, rendering locally\n");
+	scene.render(image);
+}
+#endif
+
+// Usage: PathTracing [-caustics [nPhotons]] [-guide] [-icache] [-bdpt | -mlt] [-compare seconds] [-stats]
+//                    [-time seconds [-progressive]] [-trace file.json]
+//                    [-distribute nLocalWorkers [port] | -worker host [port]]
+// Options are processed in order, so a remote worker needs the same options as the coordinator.
+// -caustics, -guide and -icache prepare the path tracer and are rejected together with -bdpt.
 int main(int argc, char * argv[]) {
+	auto start = std::chrono::steady_clock::now();			// the time budget covers the pre-passes of the options too
 	vec3 * image = new vec3[screenWidth * screenHeight];	// create image
 	Scene scene;											// create scene
 	scene.build();											// define the scene
-	scene.render(image);									// render the scene
+	int nLocalWorkers = -1, port = defaultPort;				// not distributed by default
+	const char * coordinator = NULL;
+	bool reportStats = false, progressive = false;
+	double timeBudget = 0;									// fixed nSamples by default
+	const char * prePass = NULL;							// an option preparing trace() for the final render
+	bool bidirectional = false;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-caustics") == 0 || strcmp(argv[i], "-guide") == 0 || strcmp(argv[i], "-icache") == 0) prePass = argv[i];
+		if (strcmp(argv[i], "-bdpt") == 0) bidirectional = true;
+		if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc) {	// before the pre-passes start
+			startTrace(argv[++i], "PathTracing");
+		}
+	}
+	if (prePass && bidirectional) {	// the photon map, the guide and the irradiance cache serve trace(), which -bdpt does not call
+		printf("%s cannot be combined with -bdpt\n", prePass);
+		delete[] image;
+		return 1;
+	}
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-caustics") == 0) {			// photon mapping pre-pass for caustics
+			int nPhotons = nCausticPhotons;
+			if (i + 1 < argc && atoi(argv[i + 1]) > 0) nPhotons = atoi(argv[++i]);
+			scene.shootPhotons(nPhotons);
+		}
+		else if (strcmp(argv[i], "-guide") == 0) scene.trainGuiding();	// learn the incident radiance for the diffuse bounces
+		else if (strcmp(argv[i], "-icache") == 0) scene.enableIrradianceCache();	// interpolate the indirect diffuse light
+		else if (strcmp(argv[i], "-bdpt") == 0) scene.setIntegrator(BIDIRECTIONAL);
+		else if (strcmp(argv[i], "-mlt") == 0) scene.setIntegrator(METROPOLIS);
+		else if (strcmp(argv[i], "-compare") == 0 && i + 1 < argc) {	// equal-time comparison of the integrators
+			CompareIntegrators(scene, atof(argv[++i]));
+			delete[] image;
+			return 0;
+		}
+		else if (strcmp(argv[i], "-stats") == 0) reportStats = true;	// counters and per-pixel cost (cost.tga, cost.pfm)
+		else if (strcmp(argv[i], "-time") == 0 && i + 1 < argc) timeBudget = atof(argv[++i]);	// best image in the given time
+		else if (strcmp(argv[i], "-progressive") == 0) progressive = true;	// save the image after every pass
+		else if (strcmp(argv[i], "-distribute") == 0 && i + 1 < argc) {	// coordinator of distributed rendering
+			nLocalWorkers = atoi(argv[++i]);
+			if (i + 1 < argc && atoi(argv[i + 1]) > 0) port = atoi(argv[++i]);
+		}
+		else if (strcmp(argv[i], "-worker") == 0 && i + 1 < argc) {	// worker of distributed rendering
+			coordinator = argv[++i];
+			if (i + 1 < argc && atoi(argv[i + 1]) > 0) port = atoi(argv[++i]);
+		}
+	}
+	if ((coordinator || nLocalWorkers >= 0) && !scene.hasPixelSamples()) {
+		printf("Metropolis sampling cannot be distributed by tiles\n");
+		coordinator = NULL;
+		nLocalWorkers = -1;
+	}
+	if (coordinator) {
+		int result = RunWorker(scene, coordinator, port);
+		delete[] image;
+		return result;
+	}
+	if (timeBudget > 0 && !scene.hasPixelSamples()) printf("Metropolis sampling has no passes, the time budget is ignored\n");
+	else if (timeBudget > 0 && nLocalWorkers >= 0) printf("Distributed rendering takes nSamples per pixel, the time budget is ignored\n");
+	if (nLocalWorkers >= 0) RunCoordinator(scene, nLocalWorkers, port, argc, argv, image);
+	else if (timeBudget > 0 && scene.hasPixelSamples()) {
+		double prePassTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		int spp = RenderProgressive(scene, image, timeBudget - prePassTime, progressive ? "image.tga" : NULL);
+		printf("%d samples per pixel in %.1f sec budget, %.1f sec of it before the passes\n", spp, timeBudget, prePassTime);
+	}
+	else scene.render(image);								// render the scene
+	if (scene.irradianceRecords() > 0) printf("%d irradiance records\n", scene.irradianceRecords());
 	SaveTGAFile("image.tga", image);						// write out targe image file
-	delete image;
+	if (reportStats) {
+		if (nLocalWorkers >= 0) printf("The counters do not include the samples of the workers\n");
+		scene.printStats();
+		if (scene.costImage(image)) {
+			SaveTGAFile("cost.tga", image);		// for viewing
+			scene.saveCost("cost.pfm");			// for measuring
+		}
+		else printf("No pixel cost image: distributed and Metropolis rendering do not measure it\n");
+	}
+	delete[] image;
 }
\ No newline at end of file
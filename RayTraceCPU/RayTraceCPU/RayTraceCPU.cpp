@@ -108,6 +108,7 @@ public:
 	}
 
 	void render(std::vector<vec4>& image) {
+		TRACE_SCOPE("Scene::render");
 		for (int Y = 0; Y < windowHeight; Y++) {
 #pragma omp parallel for
 			for (int X = 0; X < windowWidth; X++) {
@@ -187,25 +188,25 @@ class FullScreenTexturedQuad {
 public:
 	void Create(std::vector<vec4>& image) {
 		glGenVertexArrays(1, &vao);	// create 1 vertex array object
-		glBindVertexArray(vao);		// make it active
+		bindVertexArray(vao);		// make it active
 
 		unsigned int vbo;		// vertex buffer objects
 		glGenBuffers(1, &vbo);	// Generate 1 vertex buffer objects
 
 		// vertex coordinates: vbo0 -> Attrib Array 0 -> vertexPosition of the vertex shader
-		glBindBuffer(GL_ARRAY_BUFFER, vbo); // make it active, it is an array
+		bindBuffer(GL_ARRAY_BUFFER, vbo); // make it active, it is an array
 		float vertexCoords[] = { -1, -1,  1, -1,  1, 1,  -1, 1 };	// two triangles forming a quad
 		glBufferData(GL_ARRAY_BUFFER, sizeof(vertexCoords), vertexCoords, GL_STATIC_DRAW);	   // copy to that part of the memory which is not modified 
 		glEnableVertexAttribArray(0);
 		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);     // stride and offset: it is tightly packed
 
-		pTexture = new Texture(windowWidth, windowHeight, image);
+		pTexture = new Texture(windowWidth, windowHeight, image, GL_RGBA8);	// the frame buffer has 8 bits per channel anyway
 	}
 
 	void Draw() {
-		glBindVertexArray(vao);	// make the vao and its vbos active playing the role of the data source
+		bindVertexArray(vao);	// make the vao and its vbos active playing the role of the data source
 		pTexture->SetUniform(gpuProgram.getId(), "textureUnit");
-		glDrawArrays(GL_TRIANGLE_FAN, 0, 4);	// draw two triangles forming a quad
+		drawArrays(GL_TRIANGLE_FAN, 0, 4);	// draw two triangles forming a quad
 	}
 };
 
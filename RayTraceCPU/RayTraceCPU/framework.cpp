@@ -3,6 +3,638 @@
 // TILOS megvaltoztatni
 //=============================================================================================
 #include "framework.h"
+#include <string>
+#include <string.h>
+#include <unordered_map>
+#include <chrono>
+#include <algorithm>
+#include <sys/stat.h>
+#include <mutex>
+#if defined(_WIN32)
+#include <direct.h>
+#endif
+#if defined(FRAMEWORK_HEADLESS)
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
+
+typedef std::unordered_map<std::string, int> UniformTable;
+
+struct UniformTables {		// name -> location tables of the shader programs
+	std::unordered_map<unsigned, UniformTable> tables;
+	unsigned lastProgram = 0;			// uniforms are mostly set for the same program in a row
+	UniformTable * lastTable = NULL;
+	std::string key;					// reused, so that a lookup does not allocate
+};
+
+// Never destroyed: GPUProgram objects of other translation units unregister during static destruction
+static UniformTables& uniformTables() {
+	static UniformTables * tables = new UniformTables();
+	return *tables;
+}
+
+void registerUniforms(unsigned shaderProg) {
+	UniformTable& table = uniformTables().tables[shaderProg];
+	table.clear();
+	int nUniforms = 0, maxLength = 0;
+	glGetProgramiv(shaderProg, GL_ACTIVE_UNIFORMS, &nUniforms);
+	glGetProgramiv(shaderProg, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+	std::vector<char> name(maxLength + 1);
+	for (int i = 0; i < nUniforms; i++) {
+		int length = 0, size = 0;
+		GLenum type;
+		glGetActiveUniform(shaderProg, i, maxLength + 1, &length, &size, &type, &name[0]);
+		int location = glGetUniformLocation(shaderProg, &name[0]);
+		if (location < 0) continue;		// member of a uniform block
+		table[&name[0]] = location;
+		// arrays of basic types are reported once as "name[0]": add the plain name and every element
+		if (length > 3 && strcmp(&name[length - 3], "[0]") == 0) {
+			std::string base(&name[0], length - 3);
+			table[base] = location;
+			for (int e = 1; e < size; e++) {
+				std::string element = base + "[" + std::to_string(e) + "]";
+				table[element] = glGetUniformLocation(shaderProg, element.c_str());
+			}
+		}
+	}
+}
+
+void unregisterUniforms(unsigned shaderProg) {
+	UniformTables& tables = uniformTables();
+	tables.tables.erase(shaderProg);
+	if (tables.lastProgram == shaderProg) tables.lastTable = NULL;
+}
+
+int getUniformLocation(unsigned shaderProg, const char * name) {
+	UniformTables& tables = uniformTables();
+	if (!tables.lastTable || tables.lastProgram != shaderProg) {
+		tables.lastTable = &tables.tables[shaderProg];
+		tables.lastProgram = shaderProg;
+	}
+	tables.key.assign(name);
+	auto entry = tables.lastTable->find(tables.key);
+	// not active or the program was not linked by GPUProgram: ask the driver once and remember the answer
+	if (entry == tables.lastTable->end()) entry = tables.lastTable->emplace(tables.key, glGetUniformLocation(shaderProg, name)).first;
+	return entry->second;
+}
+
+bool simulationThreaded = true;		// FixedStepSimulation on its own thread unless -nosimthread
+
+//---------------------------
+class ProgramCache {
+//---------------------------
+	// file: header, key, binary
+	struct Header { unsigned magic, format; int keyLength, binaryLength; float compileMsec; };
+	static const unsigned magic = 0x42505347;	// "GSPB"
+	const char * directory = "shadercache";
+	bool enabled = true;
+	std::string key, fileName;	// of the last miss
+	double missStart = 0;
+	int hits = 0, misses = 0;
+	double savedMsec = 0;
+
+	double now() { return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
+	bool supported() {
+		if (!enabled) return false;
+		int nFormats = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &nFormats);
+		return nFormats > 0;
+	}
+	void makeKey(const char * vertexSource, const char * fragmentSource, const char * outputName) {
+		// a driver update invalidates the binaries
+		key = std::string((const char *)glGetString(GL_VENDOR)) + "\n" + (const char *)glGetString(GL_RENDERER) + "\n" +
+			(const char *)glGetString(GL_VERSION) + "\n" + outputName + "\n" + vertexSource + "\n" + fragmentSource;
+		unsigned long long hash = 14695981039346656037ULL;		// FNV-1a
+		for (unsigned char c : key) hash = (hash ^ c) * 1099511628211ULL;
+		char name[64];
+		sprintf(name, "/%016llx.bin", hash);
+		fileName = std::string(directory) + name;
+	}
+public:
+	void Disable() { enabled = false; }
+
+	unsigned Load(const char * vertexSource, const char * fragmentSource, const char * outputName) {
+		double start = now();
+		key.clear();
+		if (!supported()) return 0;
+		makeKey(vertexSource, fragmentSource, outputName);
+		missStart = start;
+		FILE * file = fopen(fileName.c_str(), "rb");
+		if (!file) { misses++; return 0; }
+		fseek(file, 0, SEEK_END);
+		long fileSize = ftell(file);	// a truncated or corrupt header must not size the buffers
+		fseek(file, 0, SEEK_SET);
+		Header header;
+		std::string storedKey;
+		std::vector<char> binary;
+		bool ok = fread(&header, sizeof(header), 1, file) == 1 && header.magic == magic && header.keyLength == (int)key.size() &&
+			header.binaryLength > 0 && header.binaryLength <= fileSize - (long)sizeof(header) - header.keyLength;
+		if (ok) {
+			storedKey.resize(header.keyLength);
+			binary.resize(header.binaryLength);
+			ok = fread(&storedKey[0], 1, header.keyLength, file) == (size_t)header.keyLength && storedKey == key &&
+				fread(&binary[0], 1, header.binaryLength, file) == (size_t)header.binaryLength;
+		}
+		fclose(file);
+		if (!ok) { misses++; return 0; }
+
+		unsigned shaderProg = glCreateProgram();
+		glProgramBinary(shaderProg, header.format, &binary[0], header.binaryLength);
+		int linked = 0;
+		glGetProgramiv(shaderProg, GL_LINK_STATUS, &linked);
+		if (!linked) {		// rejected by the driver: compile and overwrite
+			glDeleteProgram(shaderProg);
+			misses++;
+			return 0;
+		}
+		key.clear();
+		hits++;
+		savedMsec += header.compileMsec - (now() - start);
+		return shaderProg;
+	}
+
+	void Prepare(unsigned shaderProg) {
+		if (!key.empty()) glProgramParameteri(shaderProg, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	}
+
+	void Store(unsigned shaderProg) {
+		if (key.empty()) return;
+		Header header;
+		header.magic = magic;
+		header.keyLength = (int)key.size();
+		header.compileMsec = (float)(now() - missStart);
+		int linked = 0;
+		glGetProgramiv(shaderProg, GL_LINK_STATUS, &linked);
+		glGetProgramiv(shaderProg, GL_PROGRAM_BINARY_LENGTH, &header.binaryLength);
+		if (!linked || header.binaryLength <= 0) { key.clear(); return; }
+		std::vector<char> binary(header.binaryLength);
+		glGetProgramBinary(shaderProg, header.binaryLength, &header.binaryLength, &header.format, &binary[0]);
+#if defined(_WIN32)
+		_mkdir(directory);
+#else
+		mkdir(directory, 0755);
+#endif
+		FILE * file = fopen(fileName.c_str(), "wb");
+		if (file) {
+			fwrite(&header, sizeof(header), 1, file);
+			fwrite(key.data(), 1, key.size(), file);
+			fwrite(&binary[0], 1, header.binaryLength, file);
+			fclose(file);
+		}
+		key.clear();
+	}
+
+	void Report() {
+		if (hits + misses == 0) return;
+		printf("Shader cache : %d hits, %d misses, %.1f ms of compilation saved\n", hits, misses, savedMsec);
+	}
+} programCache;
+
+unsigned loadCachedProgram(const char * vertexSource, const char * fragmentSource, const char * fragmentShaderOutputName) {
+	return programCache.Load(vertexSource, fragmentSource, fragmentShaderOutputName);
+}
+void prepareCachedProgram(unsigned shaderProg) { programCache.Prepare(shaderProg); }
+void storeCachedProgram(unsigned shaderProg) { programCache.Store(shaderProg); }
+
+//---------------------------
+// Texel conversion and upload of Texture
+//---------------------------
+static bool hasTextureStorage() {	// glTexStorage2D: core in 4.2
+#if defined(__APPLE__)
+	return false;
+#else
+	static int supported = -1;
+	if (supported < 0) {
+		int major = 0, minor = 0, nExtensions = 0;
+		glGetIntegerv(GL_MAJOR_VERSION, &major);
+		glGetIntegerv(GL_MINOR_VERSION, &minor);
+		supported = (major > 4 || (major == 4 && minor >= 2));
+		glGetIntegerv(GL_NUM_EXTENSIONS, &nExtensions);
+		for (int i = 0; i < nExtensions && !supported; i++)
+			supported = strcmp((const char *)glGetStringi(GL_EXTENSIONS, i), "GL_ARB_texture_storage") == 0;
+	}
+	return supported > 0;
+#endif
+}
+
+// [0,1] floats to bytes, 16 at a time
+static void toUnorm8(const float * src, unsigned char * dst, int n) {
+	int i = 0;
+#if defined(FRAMEWORK_SSE)
+	const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1), scale = _mm_set1_ps(255);
+	for (; i + 16 <= n; i += 16) {
+		__m128i q[4];
+		for (int k = 0; k < 4; k++) {
+			__m128 v = _mm_min_ps(_mm_max_ps(_mm_loadu_ps(src + i + 4 * k), zero), one);
+			q[k] = _mm_cvtps_epi32(_mm_mul_ps(v, scale));		// rounds to nearest
+		}
+		__m128i bytes = _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[3]));
+		_mm_storeu_si128((__m128i *)(dst + i), bytes);
+	}
+#endif
+	for (; i < n; i++) dst[i] = (unsigned char)(fminf(fmaxf(src[i], 0), 1) * 255 + 0.5f);
+}
+
+static unsigned short toHalf(float f) {
+	unsigned int bits;
+	memcpy(&bits, &f, 4);
+	unsigned short sign = (bits >> 16) & 0x8000;
+	int exponent = (int)((bits >> 23) & 0xff) - 127 + 15;
+	unsigned int mantissa = bits & 0x7fffff;
+	if (((bits >> 23) & 0xff) == 0xff) return sign | 0x7c00 | (mantissa ? 0x200 : 0);	// inf, nan
+	if (exponent >= 31) return sign | 0x7c00;					// overflow to inf
+	if (exponent <= 0) {										// denormal or zero
+		if (exponent < -10) return sign;
+		mantissa |= 0x800000;
+		int shift = 14 - exponent;
+		return sign | (unsigned short)((mantissa + (1 << (shift - 1))) >> shift);
+	}
+	unsigned int half = sign | (exponent << 10) | (mantissa >> 13);
+	return (unsigned short)(half + ((mantissa >> 12) & 1));	// round half up, may carry into the exponent
+}
+
+static void toHalfs(const float * src, unsigned short * dst, int n) {
+	int i = 0;
+#if defined(FRAMEWORK_SSE) && defined(__F16C__)
+	for (; i + 4 <= n; i += 4) _mm_storel_epi64((__m128i *)(dst + i), _mm_cvtps_ph(_mm_loadu_ps(src + i), 0));
+#endif
+	for (; i < n; i++) dst[i] = toHalf(src[i]);
+}
+
+static unsigned char toSRGB(float linear) {		// through a table of 4096 entries
+	static unsigned char table[4096];
+	static bool initialized = false;
+	if (!initialized) {
+		for (int i = 0; i < 4096; i++) {
+			float c = i / 4095.0f;
+			c = (c <= 0.0031308f) ? c * 12.92f : 1.055f * powf(c, 1 / 2.4f) - 0.055f;
+			table[i] = (unsigned char)(c * 255 + 0.5f);
+		}
+		initialized = true;
+	}
+	return table[(int)(fminf(fmaxf(linear, 0), 1) * 4095 + 0.5f)];
+}
+
+void uploadTexture(int width, int height, const std::vector<vec4>& image, unsigned int internalFormat, bool mipmaps) {
+	int nTexels = width * height, nLevels = 1;
+	if (mipmaps) while ((std::max(width, height) >> nLevels) > 0) nLevels++;
+	const float * texels = &image[0].x;
+	std::vector<unsigned char> bytes;
+	std::vector<unsigned short> halfs;
+	GLenum format = GL_RGBA, type = GL_UNSIGNED_BYTE;
+	const void * data = NULL;
+	switch (internalFormat) {
+	case GL_RGBA32F:
+		type = GL_FLOAT;
+		data = texels;
+		break;
+	case GL_RGBA16F:
+		halfs.resize(nTexels * 4);
+		toHalfs(texels, &halfs[0], nTexels * 4);
+		type = GL_HALF_FLOAT;
+		data = &halfs[0];
+		break;
+	case GL_SRGB8_ALPHA8:
+		bytes.resize(nTexels * 4);
+		for (int i = 0; i < nTexels; i++) {
+			bytes[4 * i] = toSRGB(image[i].x); bytes[4 * i + 1] = toSRGB(image[i].y); bytes[4 * i + 2] = toSRGB(image[i].z);
+			toUnorm8(&image[i].w, &bytes[4 * i + 3], 1);
+		}
+		data = &bytes[0];
+		break;
+	case GL_R8: {
+		std::vector<float> luminance(nTexels);
+		for (int i = 0; i < nTexels; i++) luminance[i] = image[i].x;
+		bytes.resize(nTexels);
+		toUnorm8(&luminance[0], &bytes[0], nTexels);
+		format = GL_RED;
+		data = &bytes[0];
+		break;
+	}
+	default:		// GL_RGBA8
+		internalFormat = GL_RGBA8;
+		bytes.resize(nTexels * 4);
+		toUnorm8(texels, &bytes[0], nTexels * 4);
+		data = &bytes[0];
+	}
+
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);		// rows of GL_R8 are not padded
+#if !defined(__APPLE__)
+	if (hasTextureStorage()) {
+		glTexStorage2D(GL_TEXTURE_2D, nLevels, internalFormat, width, height);
+		glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, width, height, format, type, data);
+	}
+	else
+#endif
+	{
+		glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, width, height, 0, format, type, data);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, nLevels - 1);
+	}
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	if (internalFormat == GL_R8) {
+		GLint swizzle[] = { GL_RED, GL_RED, GL_RED, GL_ONE };
+		glTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_SWIZZLE_RGBA, swizzle);
+	}
+	if (mipmaps) glGenerateMipmap(GL_TEXTURE_2D);
+}
+
+//---------------------------
+// Micro-benchmark of the vector and matrix operators ("-benchmark")
+//---------------------------
+volatile float benchmarkSink;	// keeps the results alive
+
+template<typename Op> void benchmark(const char * name, Op op) {
+	const int nRuns = 2000000;
+	float sum = 0;
+	for (int i = 0; i < nRuns / 10; i++) sum += op(i);		// warm up
+	auto start = std::chrono::steady_clock::now();
+	for (int i = 0; i < nRuns; i++) sum += op(i);
+	double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+	benchmarkSink = sum;
+	printf("%-20s %8.2f ns/op\n", name, ns / nRuns);
+}
+
+void runBenchmark() {
+#if defined(FRAMEWORK_SSE) && defined(__AVX__) && defined(__FMA__)
+	printf("vec4/mat4: SSE + AVX + FMA\n");
+#elif defined(FRAMEWORK_SSE) && defined(__AVX__)
+	printf("vec4/mat4: SSE + AVX\n");
+#elif defined(FRAMEWORK_SSE)
+	printf("vec4/mat4: SSE\n");
+#else
+	printf("vec4/mat4: scalar\n");
+#endif
+	const int n = 256;		// operands, indexed by the run modulo n
+	std::vector<vec3> a3(n), b3(n);
+	std::vector<vec4> a4(n), b4(n);
+	std::vector<mat4> am(n), bm(n);
+	for (int i = 0; i < n; i++) {
+		float f = (float)i / n;
+		a3[i] = vec3(f, 1 - f, 0.5f); b3[i] = vec3(1 + f, f * f, -f);
+		a4[i] = vec4(f, 1 - f, 0.5f, 1); b4[i] = vec4(1 + f, f * f, -f, 0);
+		am[i] = RotationMatrix(f, vec3(1, f, 0.5f)) * TranslateMatrix(a3[i]);
+		bm[i] = ScaleMatrix(b3[i]) * RotationMatrix(1 - f, vec3(f, 1, 0));
+	}
+	benchmark("vec3 + vec3", [&](int i) { return (a3[i % n] + b3[i % n]).x; });
+	benchmark("vec3 * float", [&](int i) { return (a3[i % n] * 0.5f).y; });
+	benchmark("dot(vec3, vec3)", [&](int i) { return dot(a3[i % n], b3[i % n]); });
+	benchmark("cross(vec3, vec3)", [&](int i) { return cross(a3[i % n], b3[i % n]).z; });
+	benchmark("normalize(vec3)", [&](int i) { return normalize(b3[i % n]).x; });
+	benchmark("vec4 + vec4", [&](int i) { return (a4[i % n] + b4[i % n]).w; });
+	benchmark("vec4 * vec4", [&](int i) { return (a4[i % n] * b4[i % n]).z; });
+	benchmark("vec4 * float", [&](int i) { return (a4[i % n] * 0.5f).y; });
+	benchmark("dot(vec4, vec4)", [&](int i) { return dot(a4[i % n], b4[i % n]); });
+	benchmark("vec4 * mat4", [&](int i) { return (a4[i % n] * am[i % n]).x; });
+	benchmark("mat4 * mat4", [&](int i) { return (am[i % n] * bm[i % n]).m[3][1]; });
+	benchmark("mat4 * mat4 * mat4", [&](int i) { return (am[i % n] * bm[i % n] * am[(i + 1) % n]).m[2][2]; });
+	benchmark("RotationMatrix", [&](int i) { return RotationMatrix((float)i, a3[i % n]).m[0][1]; });
+	std::vector<Affine> aa(n), ba(n);
+	for (int i = 0; i < n; i++) {
+		float f = (float)i / n;
+		aa[i] = RotationAffine(f, vec3(1, f, 0.5f)) * TranslateAffine(a3[i]);
+		ba[i] = ScaleAffine(b3[i]) * RotationAffine(1 - f, vec3(f, 1, 0));
+	}
+	benchmark("Affine * Affine", [&](int i) { return (aa[i % n] * ba[i % n]).t.y; });
+	benchmark("Affine.inverse", [&](int i) { return aa[i % n].inverse().t.x; });
+	std::vector<vec4> texels(n * 16);
+	std::vector<unsigned char> bytes(n * 64);
+	for (int i = 0; i < n * 16; i++) texels[i] = vec4(i % 7 / 6.0f, i % 5 / 4.0f, i % 3 / 2.0f, 1);
+	benchmark("RGBA8 conversion x16", [&](int i) { toUnorm8(&texels[i % n * 16].x, &bytes[i % n * 64], 64); return (float)bytes[i % n * 64]; });
+	benchmark("Affine.normalMatrix", [&](int i) { return aa[i % n].normalMatrix().m[1][2]; });
+}
+
+//---------------------------
+class StateCache {
+//---------------------------
+	static const unsigned int unknown = ~0u;		// not set through the cache yet
+	static const int maxUnits = 32;
+	unsigned int program = unknown, vertexArray = unknown, arrayBuffer = unknown, framebuffer = unknown;
+	GLenum activeUnit = GL_TEXTURE0;			// default of a new context
+	unsigned int textures[maxUnits][2];			// GL_TEXTURE_2D, GL_TEXTURE_BUFFER per unit
+	std::unordered_map<GLenum, bool> capabilities;
+
+	bool change(unsigned int& cached, unsigned int value) {	// true if the call has to be made
+		if (cached == value) { nSkipped++; return false; }
+		cached = value;
+		nChanges++;
+		return true;
+	}
+	void forget(unsigned int& cached, int n, const unsigned int names[]) {	// deleted names may be generated again
+		for (int i = 0; i < n; i++) if (cached == names[i]) cached = unknown;
+	}
+	unsigned int * textureSlot(GLenum target) {
+		int unit = (int)(activeUnit - GL_TEXTURE0);
+		if (unit < 0 || unit >= maxUnits) return NULL;
+		if (target == GL_TEXTURE_2D) return &textures[unit][0];
+		if (target == GL_TEXTURE_BUFFER) return &textures[unit][1];
+		return NULL;
+	}
+public:
+	int nDraws = 0, nChanges = 0, nSkipped = 0;		// counters of the current frame
+
+	StateCache() { for (int u = 0; u < maxUnits; u++) textures[u][0] = textures[u][1] = unknown; }
+
+	void UseProgram(unsigned int p) { if (change(program, p)) glUseProgram(p); }
+	void DeleteProgram(unsigned int p) {
+		glDeleteProgram(p);
+		if (program == p) program = unknown;		// the name may be reused
+	}
+	void BindVertexArray(unsigned int v) { if (change(vertexArray, v)) glBindVertexArray(v); }
+	void DeleteVertexArrays(int n, const unsigned int v[]) {
+		glDeleteVertexArrays(n, v);
+		forget(vertexArray, n, v);
+	}
+	void BindBuffer(GLenum target, unsigned int b) {
+		if (target != GL_ARRAY_BUFFER) { nChanges++; glBindBuffer(target, b); }
+		else if (change(arrayBuffer, b)) glBindBuffer(target, b);
+	}
+	void DeleteBuffers(int n, const unsigned int b[]) {
+		glDeleteBuffers(n, b);
+		forget(arrayBuffer, n, b);
+	}
+	void ActiveTexture(GLenum unit) {
+		if (activeUnit == unit) { nSkipped++; return; }
+		activeUnit = unit;
+		nChanges++;
+		glActiveTexture(unit);
+	}
+	void BindTexture(GLenum target, unsigned int t) {
+		unsigned int * slot = textureSlot(target);
+		if (!slot) { nChanges++; glBindTexture(target, t); }
+		else if (change(*slot, t)) glBindTexture(target, t);
+	}
+	void DeleteTextures(int n, const unsigned int t[]) {
+		glDeleteTextures(n, t);
+		for (int u = 0; u < maxUnits; u++) {
+			forget(textures[u][0], n, t);
+			forget(textures[u][1], n, t);
+		}
+	}
+	void BindFramebuffer(GLenum target, unsigned int f) {
+		if (target == GL_FRAMEBUFFER) { if (change(framebuffer, f)) glBindFramebuffer(target, f); return; }
+		framebuffer = unknown;		// draw and read bindings diverge
+		nChanges++;
+		glBindFramebuffer(target, f);
+	}
+	void DeleteFramebuffers(int n, const unsigned int f[]) {
+		glDeleteFramebuffers(n, f);
+		forget(framebuffer, n, f);
+	}
+	void SetEnabled(GLenum capability, bool enabled) {
+		auto entry = capabilities.find(capability);
+		if (entry != capabilities.end() && entry->second == enabled) { nSkipped++; return; }
+		capabilities[capability] = enabled;
+		nChanges++;
+		if (enabled) glEnable(capability); else glDisable(capability);
+	}
+} stateCache;
+
+void useProgram(unsigned int program) { stateCache.UseProgram(program); }
+void deleteProgram(unsigned int program) { stateCache.DeleteProgram(program); }
+void bindVertexArray(unsigned int vertexArray) { stateCache.BindVertexArray(vertexArray); }
+void deleteVertexArrays(int n, const unsigned int vertexArrays[]) { stateCache.DeleteVertexArrays(n, vertexArrays); }
+void bindBuffer(GLenum target, unsigned int buffer) { stateCache.BindBuffer(target, buffer); }
+void deleteBuffers(int n, const unsigned int buffers[]) { stateCache.DeleteBuffers(n, buffers); }
+void activeTexture(GLenum unit) { stateCache.ActiveTexture(unit); }
+void bindTexture(GLenum target, unsigned int texture) { stateCache.BindTexture(target, texture); }
+void deleteTextures(int n, const unsigned int textures[]) { stateCache.DeleteTextures(n, textures); }
+void bindFramebuffer(GLenum target, unsigned int framebuffer) { stateCache.BindFramebuffer(target, framebuffer); }
+void deleteFramebuffers(int n, const unsigned int framebuffers[]) { stateCache.DeleteFramebuffers(n, framebuffers); }
+void setEnabled(GLenum capability, bool enabled) { stateCache.SetEnabled(capability, enabled); }
+void drawArrays(GLenum mode, int first, int count) {
+	stateCache.nDraws++;
+	glDrawArrays(mode, first, count);
+}
+void drawElements(GLenum mode, int count, GLenum type, const void * indices) {
+	stateCache.nDraws++;
+	glDrawElements(mode, count, type, indices);
+}
+
+//---------------------------
+class FrameProfiler {
+//---------------------------
+public:
+	enum Section { FRAME, GPU, IDLE, DISPLAY, SWAP, nSections };
+private:
+	static const int windowSize = 120;		// frames in the sliding window
+	std::vector<float> samples[nSections];	// msec, ring buffers
+	std::vector<int> draws, changes, skipped;	// per frame, rings of the state cache counts
+	int nSamples[nSections] = { 0 };
+	double sectionStart[nSections];
+	double cpuFrame[nSections] = { 0 };		// CPU times of this frame, the idle calls before it included
+	double prevFrame[nSections] = { 0 };	// CPU times of the previous frame, written to the trace with its GPU time
+	unsigned int queries[2];				// timer queries of this and of the previous frame
+	bool queryPending[2] = { false, false };
+	bool queryActive = false;
+	int frame = 0;
+	double lastFrameStart = -1, lastReport = 0;
+	FILE * csv = NULL;
+
+	double now() { return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now().time_since_epoch()).count(); }
+	void add(Section s, float msec) {
+		samples[s][nSamples[s] % windowSize] = msec;
+		nSamples[s]++;
+	}
+	// the result of the previous frame is normally ready, the pipeline is never drained waiting for it
+	float gpuResult(int q) {
+		if (!queryPending[q]) return -1;
+		int available = 0;
+		glGetQueryObjectiv(queries[q], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available) return -1;
+		GLuint64 nsec;
+		glGetQueryObjectui64v(queries[q], GL_QUERY_RESULT, &nsec);
+		queryPending[q] = false;
+		return nsec / 1e6f;
+	}
+	void report() {
+		const char * names[nSections] = { "frame", "gpu", "idle", "display", "swap" };
+		printf("\n[profile, msec min/avg/p99 of %d frames]", windowSize);
+		for (int s = 0; s < nSections; s++) {
+			int n = std::min(nSamples[s], windowSize);
+			if (n == 0) continue;
+			std::vector<float> sorted(samples[s].begin(), samples[s].begin() + n);
+			std::sort(sorted.begin(), sorted.end());
+			float sum = 0;
+			for (float v : sorted) sum += v;
+			printf(" %s %.2f/%.2f/%.2f", names[s], sorted[0], sum / n, sorted[(99 * n - 1) / 100]);
+		}
+		int n = std::min(frame, windowSize);
+		if (n > 0) {
+			double sums[3] = { 0, 0, 0 };
+			for (int i = 0; i < n; i++) { sums[0] += draws[i]; sums[1] += changes[i]; sums[2] += skipped[i]; }
+			printf(" | per frame: %.1f draws, %.1f state changes, %.1f redundant skipped", sums[0] / n, sums[1] / n, sums[2] / n);
+		}
+		printf("\n");
+	}
+public:
+	void Init(const char * csvFileName) {
+		for (int s = 0; s < nSections; s++) samples[s].resize(windowSize);
+		draws.resize(windowSize); changes.resize(windowSize); skipped.resize(windowSize);
+		glGenQueries(2, queries);
+		if (csvFileName) {
+			csv = fopen(csvFileName, "w");
+			if (csv) fprintf(csv, "frame,frame_ms,gpu_ms,idle_ms,display_ms,swap_ms,draws,state_changes,skipped\n");
+			else printf("File %s cannot be opened\n", csvFileName);
+		}
+		lastReport = now();
+	}
+	void Begin(Section s) { sectionStart[s] = now(); }
+	void End(Section s) {
+		double msec = now() - sectionStart[s];
+		cpuFrame[s] += msec;
+		add(s, msec);
+	}
+	void BeginFrame() {
+		double t = now();
+		cpuFrame[FRAME] = (lastFrameStart < 0) ? 0 : t - lastFrameStart;
+		stateCache.nDraws = stateCache.nChanges = stateCache.nSkipped = 0;		// idle calls are not counted
+		if (lastFrameStart >= 0) add(FRAME, cpuFrame[FRAME]);
+		lastFrameStart = t;
+		int q = frame % 2;
+		gpuResult(q);		// drop a result that never became available
+		glBeginQuery(GL_TIME_ELAPSED, queries[q]);
+		queryPending[q] = queryActive = true;
+		Begin(DISPLAY);
+	}
+	// the GPU time of the frame ends at the buffer swap or at the end of onDisplay
+	void EndGPU() {
+		if (queryActive) glEndQuery(GL_TIME_ELAPSED);
+		queryActive = false;
+	}
+	void EndFrame() {
+		EndGPU();
+		End(DISPLAY);
+		float gpu = gpuResult((frame + 1) % 2);		// previous frame, -1 if not known
+		if (frame <= 1) gpu = -1;					// the first frame compiles shaders and uploads data
+		if (gpu >= 0) add(GPU, gpu);
+		// software drivers like llvmpipe render at the swap, their GPU time is about zero and the swap time is the rendering
+		if (csv && frame > 0) fprintf(csv, "%d,%.3f,%.3f,%.3f,%.3f,%.3f,%d,%d,%d\n", frame - 1, prevFrame[FRAME], gpu, prevFrame[IDLE],
+			prevFrame[DISPLAY], prevFrame[SWAP], draws[(frame - 1) % windowSize], changes[(frame - 1) % windowSize], skipped[(frame - 1) % windowSize]);
+		draws[frame % windowSize] = stateCache.nDraws;
+		changes[frame % windowSize] = stateCache.nChanges;
+		skipped[frame % windowSize] = stateCache.nSkipped;
+		for (int s = 0; s < nSections; s++) {
+			prevFrame[s] = cpuFrame[s];
+			cpuFrame[s] = 0;
+		}
+		frame++;
+		if (now() - lastReport > 5000) {
+			report();
+			lastReport = now();
+		}
+	}
+	~FrameProfiler() { if (csv) fclose(csv); }
+};
+
+FrameProfiler frameProfiler;
+
+void swapBuffersProfiled() {
+	frameProfiler.EndGPU();
+	frameProfiler.Begin(FrameProfiler::SWAP);
+	TRACE_SCOPE("SwapBuffers");
+	(glutSwapBuffers)();	// the real one, not the macro
+	frameProfiler.End(FrameProfiler::SWAP);
+}
 
 // Initialization
 void onInitialization();
@@ -25,8 +657,174 @@ void onMouse(int button, int state, int pX, int pY);
 // Idle event indicating that some time elapsed: do animation here
 void onIdle();
 
+void onDisplayProfiled() {
+	frameProfiler.BeginFrame();
+	TRACE_SCOPE("onDisplay");
+	onDisplay();				// display time includes the buffer swap
+	frameProfiler.EndFrame();
+}
+
+void onIdleProfiled() {
+	frameProfiler.Begin(FrameProfiler::IDLE);
+	TRACE_SCOPE("onIdle");
+	onIdle();
+	frameProfiler.End(FrameProfiler::IDLE);
+}
+
+static bool hasOption(int argc, char * argv[], const char * option) {
+	for (int i = 1; i < argc; i++) if (strcmp(argv[i], option) == 0) return true;
+	return false;
+}
+
+static int programArgc = 0;
+static char ** programArgv = NULL;
+
+bool hasCommandLineOption(const char * option) { return hasOption(programArgc, programArgv, option); }
+
+// Common part of the backends once the context exists
+static void startProgram(int argc, char * argv[]) {
+	programArgc = argc;
+	programArgv = argv;
+	int majorVersion, minorVersion;
+	printf("GL Vendor    : %s\n", glGetString(GL_VENDOR));
+	printf("GL Renderer  : %s\n", glGetString(GL_RENDERER));
+	printf("GL Version (string)  : %s\n", glGetString(GL_VERSION));
+	glGetIntegerv(GL_MAJOR_VERSION, &majorVersion);
+	glGetIntegerv(GL_MINOR_VERSION, &minorVersion);
+	printf("GL Version (integer) : %d.%d\n", majorVersion, minorVersion);
+	printf("GLSL Version : %s\n", glGetString(GL_SHADING_LANGUAGE_VERSION));
+
+	// -profile file.csv: trace every frame into a csv file
+	const char * csvFileName = NULL;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-profile") == 0 && i + 1 < argc) csvFileName = argv[i + 1];
+		if (strcmp(argv[i], "-noshadercache") == 0) programCache.Disable();
+		if (strcmp(argv[i], "-nosimthread") == 0) simulationThreaded = false;
+		if (strcmp(argv[i], "-trace") == 0 && i + 1 < argc) {
+			startTrace(argv[i + 1], "framework");
+		}
+	}
+	frameProfiler.Init(csvFileName);
+
+	// Initialize this program and create shaders
+	{
+		TRACE_SCOPE("onInitialization");
+		onInitialization();
+	}
+	programCache.Report();
+}
+
+#if defined(FRAMEWORK_HEADLESS)
+//---------------------------
+// Headless backend: an EGL pbuffer stands in for the window, so it runs without a display server, and with Mesa's
+// surfaceless platform and llvmpipe without a GPU. Options:
+//   -frames N        number of onDisplay/onIdle iterations (1)
+//   -keys abc        keys pressed and released after onInitialization
+//   -timestep ms     GLUT_ELAPSED_TIME advances by this much per frame instead of following the clock, and
+//                    FixedStepSimulation steps on the render thread
+//   -output f.ppm    the last frame
+//   -dump prefix     every frame as prefix0000.ppm, prefix0001.ppm, ...
+//---------------------------
+static int headlessFrame = 0;
+static float headlessTimestep = 0;
+static auto headlessStart = std::chrono::steady_clock::now();
+
+int glutGet(GLenum state) {
+	if (state != GLUT_ELAPSED_TIME) return 0;
+	if (headlessTimestep > 0) return (int)(headlessFrame * headlessTimestep);
+	return (int)std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - headlessStart).count();
+}
+void glutPostRedisplay() { }		// every iteration redraws
+void (glutSwapBuffers)() { glFlush(); }
+int glutCreateMenu(void (*callback)(int)) { return 0; }
+void glutAddMenuEntry(const char * label, int value) { }
+void glutAttachMenu(int button) { }
+
+static bool createHeadlessContext() {
+#if !defined(EGL_PLATFORM_SURFACELESS_MESA)
+#define EGL_PLATFORM_SURFACELESS_MESA 0x31DD
+#endif
+	EGLDisplay display = EGL_NO_DISPLAY;
+	PFNEGLGETPLATFORMDISPLAYEXTPROC getPlatformDisplay = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+	if (getPlatformDisplay) display = getPlatformDisplay(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, NULL);
+	if (display == EGL_NO_DISPLAY) display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+	if (display == EGL_NO_DISPLAY || !eglInitialize(display, NULL, NULL)) return false;
+
+	EGLint configAttributes[] = { EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+		EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_ALPHA_SIZE, 8, EGL_DEPTH_SIZE, 24, EGL_NONE };
+	EGLConfig config;
+	EGLint nConfigs = 0;
+	if (!eglChooseConfig(display, configAttributes, &config, 1, &nConfigs) || nConfigs < 1) return false;
+	EGLint surfaceAttributes[] = { EGL_WIDTH, (EGLint)windowWidth, EGL_HEIGHT, (EGLint)windowHeight, EGL_NONE };
+	EGLSurface surface = eglCreatePbufferSurface(display, config, surfaceAttributes);
+	if (surface == EGL_NO_SURFACE || !eglBindAPI(EGL_OPENGL_API)) return false;
+	EGLContext context = eglCreateContext(display, config, EGL_NO_CONTEXT, NULL);	// highest compatibility profile
+	if (context == EGL_NO_CONTEXT) return false;
+	return eglMakeCurrent(display, surface, surface, context) == EGL_TRUE;
+}
+
+static void saveFrame(const char * fileName) {
+	std::vector<unsigned char> pixels(windowWidth * windowHeight * 3);
+	glPixelStorei(GL_PACK_ALIGNMENT, 1);
+	glReadPixels(0, 0, windowWidth, windowHeight, GL_RGB, GL_UNSIGNED_BYTE, &pixels[0]);
+	FILE * file = fopen(fileName, "wb");
+	if (!file) { printf("cannot write %s\n", fileName); return; }
+	fprintf(file, "P6 %d %d 255\n", windowWidth, windowHeight);
+	for (int y = windowHeight - 1; y >= 0; y--) fwrite(&pixels[y * windowWidth * 3], 1, windowWidth * 3, file);
+	fclose(file);
+}
+
 // Entry point of the application
 int main(int argc, char * argv[]) {
+	if (hasOption(argc, argv, "-benchmark")) { runBenchmark(); return 0; }
+
+	int nFrames = 1;
+	const char * keys = "", * outputFileName = NULL, * dumpPrefix = NULL;
+	for (int i = 1; i + 1 < argc; i++) {
+		if (strcmp(argv[i], "-frames") == 0) nFrames = atoi(argv[i + 1]);
+		if (strcmp(argv[i], "-keys") == 0) keys = argv[i + 1];
+		if (strcmp(argv[i], "-timestep") == 0) {
+			headlessTimestep = (float)atof(argv[i + 1]);
+			simulationThreaded = false;
+		}
+		if (strcmp(argv[i], "-output") == 0) outputFileName = argv[i + 1];
+		if (strcmp(argv[i], "-dump") == 0) dumpPrefix = argv[i + 1];
+	}
+	if (!createHeadlessContext()) {
+		printf("Cannot create an EGL context\n");
+		return 1;
+	}
+	startProgram(argc, argv);
+
+	for (const char * key = keys; *key; key++) {
+		onKeyboard(*key, 0, 0);
+		onKeyboardUp(*key, 0, 0);
+	}
+	auto start = std::chrono::steady_clock::now();
+	for (headlessFrame = 0; headlessFrame < nFrames; headlessFrame++) {
+		onDisplayProfiled();
+		if (dumpPrefix) {
+			char fileName[1024];
+			snprintf(fileName, sizeof(fileName), "%s%04d.ppm", dumpPrefix, headlessFrame);
+			saveFrame(fileName);
+		}
+		onIdleProfiled();
+	}
+	glFinish();
+	double msec = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	printf("\n%d frames, %.2f ms/frame\n", nFrames, msec / nFrames);
+	if (outputFileName) saveFrame(outputFileName);
+	return 0;
+}
+#else
+static void onSpecialKey(int key, int pX, int pY) {
+	if (key == GLUT_KEY_F12) saveTrace();
+}
+
+// Entry point of the application
+int main(int argc, char * argv[]) {
+	if (hasOption(argc, argv, "-benchmark")) { runBenchmark(); return 0; }
+
 	// Initialize GLUT, Glew and OpenGL 
 	glutInit(&argc, argv);
 
@@ -48,24 +846,17 @@ int main(int argc, char * argv[]) {
 	glewExperimental = true;	// magic
 	glewInit();
 #endif
-	printf("GL Vendor    : %s\n", glGetString(GL_VENDOR));
-	printf("GL Renderer  : %s\n", glGetString(GL_RENDERER));
-	printf("GL Version (string)  : %s\n", glGetString(GL_VERSION));
-	glGetIntegerv(GL_MAJOR_VERSION, &majorVersion);
-	glGetIntegerv(GL_MINOR_VERSION, &minorVersion);
-	printf("GL Version (integer) : %d.%d\n", majorVersion, minorVersion);
-	printf("GLSL Version : %s\n", glGetString(GL_SHADING_LANGUAGE_VERSION));
+	startProgram(argc, argv);
 
-	// Initialize this program and create shaders
-	onInitialization();
-
-	glutDisplayFunc(onDisplay);                // Register event handlers
+	glutDisplayFunc(onDisplayProfiled);                // Register event handlers
 	glutMouseFunc(onMouse);
-	glutIdleFunc(onIdle);
+	glutIdleFunc(onIdleProfiled);
 	glutKeyboardFunc(onKeyboard);
 	glutKeyboardUpFunc(onKeyboardUp);
 	glutMotionFunc(onMouseMotion);
+	glutSpecialFunc(onSpecialKey);
 
 	glutMainLoop();
 	return 1;
 }
+#endif
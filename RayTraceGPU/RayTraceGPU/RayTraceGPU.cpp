@@ -2,6 +2,10 @@
 // Computer Graphics Sample Program: GPU ray casting
 //=============================================================================================
 #include "framework.h"
+#include <chrono>
+#include <algorithm>
+#include <string>
+#include <map>
 
 // vertex shader in GLSL
 const char *vertexSource = R"(
@@ -18,16 +22,21 @@ const char *vertexSource = R"(
 		p = wLookAt + wRight * cCamWindowVertex.x + wUp * cCamWindowVertex.y;
 	}
 )";
-// fragment shader in GLSL
+// fragment shader in GLSL, specialized by the #define block of ShaderVariants:
+// N_OBJECTS, N_MATERIAL0_OBJECTS (the first spheres use material 0, the rest material 1), MAX_DEPTH,
+// ROUGH_MATERIALS and REFLECTIVE_MATERIALS (bool[2] constants), HAS_ROUGH and HAS_REFLECTIVE
 const char *fragmentSource = R"(
-	#version 450
 	precision highp float;
 
+	// std430 layout, the scalars fill the 4th component of the preceding vec3
 	struct Material {
-		vec3 ka, kd, ks;
-		float  shininess;
+		vec3 ka;
+		float shininess;
+		vec3 kd;
+		int rough;
+		vec3 ks;
+		int reflective;
 		vec3 F0;
-		int rough, reflective;
 	};
 
 	struct Light {
@@ -40,6 +49,7 @@ const char *fragmentSource = R"(
 		float radius;
 	};
 
+
 	struct Hit {
 		float t;
 		vec3 position, normal;
@@ -50,13 +60,21 @@ const char *fragmentSource = R"(
 		vec3 start, dir;
 	};
 
-	const int nMaxObjects = 500;
-
 	uniform vec3 wEye; 
-	uniform Light light;     
-	uniform Material materials[2];  // diffuse, specular, ambient ref
-	uniform int nObjects;
-	uniform Sphere objects[nMaxObjects];
+
+	// static scene data, uploaded only when it changes
+	layout(std430, binding = 0) readonly buffer SceneData {
+		Light light;
+		Material materials[2];  // diffuse, specular, ambient ref
+		int nObjects;
+		Sphere objects[];
+	};
+
+	// bounding volume hierarchy in depth first order, two texels per node: (bmin, skip), (bmax, sphere)
+	// the first child follows its parent, skip is the node to continue with when the box is missed or the subtree is done
+	// sphere is the sphere of a leaf, -1 for inner nodes; a sphere per leaf makes 2 N_OBJECTS - 1 nodes
+	uniform samplerBuffer bvh;
+	const int nNodes = 2 * N_OBJECTS - 1;
 
 	in  vec3 p;					// point on camera window corresponding to the pixel
 	out vec4 fragmentColor;		// output that goes to the raster memory as told by glBindFragDataLocation
@@ -80,21 +98,53 @@ const char *fragmentSource = R"(
 		return hit;
 	}
 
+	// slab test: does the ray enter the box before tmax
+	bool intersectBox(vec3 bmin, vec3 bmax, vec3 start, vec3 invDir, float tmax) {
+		vec3 t0 = (bmin - start) * invDir, t1 = (bmax - start) * invDir;
+		vec3 tNear = min(t0, t1), tFar = max(t0, t1);
+		float tEnter = max(max(tNear.x, tNear.y), tNear.z);
+		float tExit = min(min(tFar.x, tFar.y), tFar.z);
+		return tEnter <= tExit && tExit > 0 && tEnter < tmax;
+	}
+
+	// stackless traversal of the hierarchy following the skip links
 	Hit firstIntersect(Ray ray) {
 		Hit bestHit;
 		bestHit.t = -1;
-		for (int o = 0; o < nObjects; o++) {
-			Hit hit = intersect(objects[o], ray); //  hit.t < 0 if no intersection
-			if (o < nObjects/2) hit.mat = 0;	 // half of the objects are rough
-			else			    hit.mat = 1;     // half of the objects are reflective
-			if (hit.t > 0 && (bestHit.t < 0 || hit.t < bestHit.t))  bestHit = hit;
+		vec3 invDir = 1.0 / ray.dir;
+		int n = 0;
+		while (n < nNodes) {
+			vec4 bmin = texelFetch(bvh, 2 * n), bmax = texelFetch(bvh, 2 * n + 1);
+			int o = int(bmax.w);
+			if (o >= 0) {
+				Hit hit = intersect(objects[o], ray); //  hit.t < 0 if no intersection
+				hit.mat = (o < N_MATERIAL0_OBJECTS) ? 0 : 1;
+				if (hit.t > 0 && (bestHit.t < 0 || hit.t < bestHit.t))  bestHit = hit;
+				n = int(bmin.w);
+			} else if (intersectBox(bmin.xyz, bmax.xyz, ray.start, invDir, (bestHit.t < 0) ? 1e30 : bestHit.t)) {
+				n++;
+			} else {
+				n = int(bmin.w);
+			}
 		}
 		if (dot(ray.dir, bestHit.normal) > 0) bestHit.normal = bestHit.normal * (-1);
 		return bestHit;
 	}
 
-	bool shadowIntersect(Ray ray) {	// for directional lights
-		for (int o = 0; o < nObjects; o++) if (intersect(objects[o], ray).t > 0) return true; //  hit.t < 0 if no intersection
+	bool shadowIntersect(Ray ray) {	// for directional lights, any hit will do
+		vec3 invDir = 1.0 / ray.dir;
+		int n = 0;
+		while (n < nNodes) {
+			vec4 bmin = texelFetch(bvh, 2 * n), bmax = texelFetch(bvh, 2 * n + 1);
+			if (bmax.w >= 0) {
+				if (intersect(objects[int(bmax.w)], ray).t > 0) return true; //  hit.t < 0 if no intersection
+				n = int(bmin.w);
+			} else if (intersectBox(bmin.xyz, bmax.xyz, ray.start, invDir, 1e30)) {
+				n++;
+			} else {
+				n = int(bmin.w);
+			}
+		}
 		return false;
 	}
 
@@ -103,15 +153,20 @@ const char *fragmentSource = R"(
 	}
 
 	const float epsilon = 0.0001f;
-	const int maxdepth = 5;
+	const int maxdepth = MAX_DEPTH;
+	const bool roughMaterial[2] = ROUGH_MATERIALS;
+	const bool reflectiveMaterial[2] = REFLECTIVE_MATERIALS;
 
-	vec3 trace(Ray ray) {
+	vec3 trace(Ray ray, out float depth) {	// depth: distance of the first hit, -1 for the background
 		vec3 weight = vec3(1, 1, 1);
 		vec3 outRadiance = vec3(0, 0, 0);
+		depth = -1;
 		for(int d = 0; d < maxdepth; d++) {
 			Hit hit = firstIntersect(ray);
+			if (d == 0) depth = hit.t;
 			if (hit.t < 0) return weight * light.La;
-			if (materials[hit.mat].rough == 1) {
+#if HAS_ROUGH
+			if (roughMaterial[hit.mat]) {
 				outRadiance += weight * materials[hit.mat].ka * light.La;
 				Ray shadowRay;
 				shadowRay.start = hit.position + hit.normal * epsilon;
@@ -124,23 +179,170 @@ const char *fragmentSource = R"(
 					if (cosDelta > 0) outRadiance += weight * light.Le * materials[hit.mat].ks * pow(cosDelta, materials[hit.mat].shininess);
 				}
 			}
-
-			if (materials[hit.mat].reflective == 1) {
+#endif
+#if HAS_REFLECTIVE
+			if (reflectiveMaterial[hit.mat]) {
 				weight *= Fresnel(materials[hit.mat].F0, dot(-ray.dir, hit.normal));
 				ray.start = hit.position + hit.normal * epsilon;
 				ray.dir = reflect(ray.dir, hit.normal);
 			} else return outRadiance;
+#else
+			return outRadiance;
+#endif
 		}
+		return outRadiance;
+	}
+
+	// temporal reprojection: half of the pixels are traced in a checkerboard of 8x8 tiles alternating every frame,
+	// the others reuse the previous frame where it saw the same surface; whole tiles keep the SIMD lanes coherent
+	uniform bool temporal;
+	uniform int frameParity;
+	uniform sampler2D history;		// previous frame: radiance and depth
+	uniform ivec2 historySize;		// resolution the previous frame was rendered at
+	uniform vec3 wEyePrev, wLookAtPrev, wRightPrev, wUpPrev;
+
+	// previous frame pixel that saw point x, or (-1, -1)
+	ivec2 reproject(vec3 x) {
+		vec3 w = wEyePrev - wLookAtPrev;
+		vec3 d = x - wEyePrev;
+		float s = -dot(w, w) / dot(d, w);		// ray from the previous eye to x hits the window at eye + d * s
+		vec3 q = wEyePrev + d * s - wLookAtPrev;
+		vec2 c = vec2(dot(q, wRightPrev) / dot(wRightPrev, wRightPrev), dot(q, wUpPrev) / dot(wUpPrev, wUpPrev));
+		ivec2 pixel = ivec2(floor((c * 0.5 + 0.5) * vec2(historySize)));
+		if (s <= 0 || any(lessThan(pixel, ivec2(0))) || any(greaterThanEqual(pixel, historySize))) return ivec2(-1);
+		return pixel;
+	}
+
+	// Blinn-Phong highlight of a rough hit seen from eye, without the shadow test
+	vec3 specular(Hit hit, vec3 eye) {
+		vec3 halfway = normalize(normalize(eye - hit.position) + light.direction);
+		float cosDelta = dot(hit.normal, halfway);
+		return (cosDelta > 0) ? light.Le * materials[hit.mat].ks * pow(cosDelta, materials[hit.mat].shininess) : vec3(0, 0, 0);
 	}
 
 	void main() {
 		Ray ray;
 		ray.start = wEye; 
 		ray.dir = normalize(p - wEye);
-		fragmentColor = vec4(trace(ray), 1); 
+		ivec2 pixel = ivec2(gl_FragCoord.xy);
+		if (temporal && (((pixel.x >> 3) + (pixel.y >> 3)) & 1) != frameParity) {
+			Hit hit = firstIntersect(ray);
+			if (hit.t < 0) {
+				fragmentColor = vec4(light.La, -1);
+				return;
+			}
+			ivec2 prevPixel = reproject(hit.position);
+			// the camera moves: mirrors are never reused, rough surfaces only where their highlight changed by less
+			// than a step of the 8 bit output, lit or in shadow, so the view independent ambient and diffuse terms remain
+			if (prevPixel.x >= 0 && !reflectiveMaterial[hit.mat] &&
+				all(lessThan(abs(specular(hit, wEye) - specular(hit, wEyePrev)), vec3(1.0 / 255)))) {
+				vec4 prev = texelFetch(history, prevPixel, 0);
+				float prevDepth = length(hit.position - wEyePrev);
+				// the previous frame saw another surface there: disocclusion, trace the pixel
+				if (prev.a > 0 && abs(prev.a - prevDepth) < 0.01 * prevDepth) {
+					fragmentColor = vec4(prev.rgb, hit.t);
+					return;
+				}
+			}
+		}
+		float depth;
+		vec3 radiance = trace(ray, depth);
+		fragmentColor = vec4(radiance, depth); 
+	}
+)";
+
+// upsampling of the frame rendered at reduced resolution to the window
+const char *upsampleVertexSource = R"(
+	#version 450
+	precision highp float;
+
+	layout(location = 0) in vec2 cCamWindowVertex;	// Attrib Array 0
+	out vec2 texCoord;
+
+	void main() {
+		gl_Position = vec4(cCamWindowVertex, 0, 1);
+		texCoord = (cCamWindowVertex + vec2(1, 1)) / 2;
+	}
+)";
+
+// joint bilateral upsampling: bilinear weights of the 4 nearest low resolution pixels, damped where their depth
+// differs from the depth of the nearest one, so edges between objects and the background are not blurred
+const char *upsampleFragmentSource = R"(
+	#version 450
+	precision highp float;
+
+	uniform sampler2D frame;		// radiance and depth (-1 for the background)
+	uniform ivec2 renderSize;		// the part of frame that was rendered
+
+	in vec2 texCoord;
+	out vec4 fragmentColor;
+
+	float depthOf(vec4 texel) { return (texel.a < 0) ? 1e3 : texel.a; }
+
+	void main() {
+		vec2 st = texCoord * vec2(renderSize) - vec2(0.5, 0.5);
+		ivec2 base = ivec2(floor(st));
+		vec2 f = st - vec2(base);
+		vec4 nearest = texelFetch(frame, clamp(ivec2(floor(st + vec2(0.5, 0.5))), ivec2(0), renderSize - 1), 0);
+		float refDepth = depthOf(nearest);
+		vec3 sum = vec3(0, 0, 0);
+		float sumWeight = 0;
+		for (int j = 0; j < 2; j++) {
+			for (int i = 0; i < 2; i++) {
+				vec4 texel = texelFetch(frame, clamp(base + ivec2(i, j), ivec2(0), renderSize - 1), 0);
+				float bilinear = ((i == 0) ? 1 - f.x : f.x) * ((j == 0) ? 1 - f.y : f.y);
+				float w = bilinear * exp(-abs(depthOf(texel) - refDepth) / (0.02 * refDepth));
+				sum += texel.rgb * w;
+				sumWeight += w;
+			}
+		}
+		fragmentColor = vec4((sumWeight > 1e-4) ? sum / sumWeight : nearest.rgb, 1);
 	}
 )";
 
+// CPU side mirrors of the std430 structs of the SceneData shader storage buffer
+struct GPUMaterial {
+	vec3 ka;
+	float shininess;
+	vec3 kd;
+	int rough;
+	vec3 ks;
+	int reflective;
+	vec3 F0;
+	float pad;
+};
+
+struct GPULight {
+	vec3 direction;
+	float pad0;
+	vec3 Le;
+	float pad1;
+	vec3 La;
+	float pad2;
+};
+
+struct GPUSphere {
+	vec3 center;
+	float radius;
+};
+
+// texels of the bvh texture buffer, the indices are stored as floats
+struct GPUNode {
+	vec3 bmin;
+	float skip;
+	vec3 bmax;
+	float sphere;
+};
+
+const int nMaterials = 2;
+
+struct GPUSceneHeader {
+	GPULight light;
+	GPUMaterial materials[nMaterials];
+	int nObjects;
+	int pad[3];		// the sphere array is 16 byte aligned
+};
+
 class Material {
 protected:
 	vec3 ka, kd, ks;
@@ -161,26 +363,11 @@ public:
 		rough = false;
 		reflective = true;
 	}
-	void SetUniform(unsigned int shaderProg, int mat) {
-		char buffer[256];
-		sprintf(buffer, "materials[%d].ka", mat);
-		ka.SetUniform(shaderProg, buffer);
-		sprintf(buffer, "materials[%d].kd", mat);
-		kd.SetUniform(shaderProg, buffer);
-		sprintf(buffer, "materials[%d].ks", mat);
-		ks.SetUniform(shaderProg, buffer);
-		sprintf(buffer, "materials[%d].shininess", mat);
-		int location = glGetUniformLocation(shaderProg, buffer);
-		if (location >= 0) glUniform1f(location, shininess); else printf("uniform material.shininess cannot be set\n");
-		sprintf(buffer, "materials[%d].F0", mat);
-		F0.SetUniform(shaderProg, buffer);
-
-		sprintf(buffer, "materials[%d].rough", mat);
-		location = glGetUniformLocation(shaderProg, buffer);
-		if (location >= 0) glUniform1i(location, rough ? 1 : 0); else printf("uniform material.rough cannot be set\n");
-		sprintf(buffer, "materials[%d].reflective", mat);
-		location = glGetUniformLocation(shaderProg, buffer);
-		if (location >= 0) glUniform1i(location, reflective ? 1 : 0); else printf("uniform material.reflective cannot be set\n");
+	void Pack(GPUMaterial& gpu) {
+		gpu.ka = ka; gpu.kd = kd; gpu.ks = ks; gpu.F0 = F0;
+		gpu.shininess = shininess;
+		gpu.rough = rough ? 1 : 0;
+		gpu.reflective = reflective ? 1 : 0;
 	}
 };
 
@@ -210,14 +397,7 @@ struct Sphere {
 	float radius;
 
 	Sphere(const vec3& _center, float _radius) { center = _center; radius = _radius; }
-	void SetUniform(unsigned int shaderProg, int o) {
-		char buffer[256];
-		sprintf(buffer, "objects[%d].center", o);
-		center.SetUniform(shaderProg, buffer);
-		sprintf(buffer, "objects[%d].radius", o);
-		int location = glGetUniformLocation(shaderProg, buffer);
-		if (location >= 0) glUniform1f(location, radius); else printf("uniform %s cannot be set\n", buffer);
-	}
+	void Pack(GPUSphere& gpu) { gpu.center = center; gpu.radius = radius; }
 };
 
 class Camera {
@@ -239,11 +419,14 @@ public:
 			-(eye.x - lookat.x) * sin(dt) + (eye.z - lookat.z) * cos(dt) + lookat.z);
 		set(eye, lookat, up, fov);
 	}
-	void SetUniform(unsigned int shaderProg) {
-		eye.SetUniform(shaderProg, "wEye");
-		lookat.SetUniform(shaderProg, "wLookAt");
-		right.SetUniform(shaderProg, "wRight");
-		up.SetUniform(shaderProg, "wUp");
+	vec3 getEye() { return eye; }
+	// point of the camera window at normalized device coordinates (cX, cY), as computed by the vertex shader
+	vec3 windowPoint(float cX, float cY) { return lookat + right * cX + up * cY; }
+	void SetUniform(unsigned int shaderProg, bool previous = false) {	// previous: camera of the last frame for reprojection
+		eye.SetUniform(shaderProg, previous ? "wEyePrev" : "wEye");
+		lookat.SetUniform(shaderProg, previous ? "wLookAtPrev" : "wLookAt");
+		right.SetUniform(shaderProg, previous ? "wRightPrev" : "wRight");
+		up.SetUniform(shaderProg, previous ? "wUpPrev" : "wUp");
 	}
 };
 
@@ -254,20 +437,65 @@ struct Light {
 		direction = normalize(_direction);
 		Le = _Le; La = _La;
 	}
-	void SetUniform(unsigned int shaderProg) {
-		La.SetUniform(shaderProg, "light.La");
-		Le.SetUniform(shaderProg, "light.Le");
-		direction.SetUniform(shaderProg, "light.direction");
+	void Pack(GPULight& gpu) {
+		gpu.direction = direction;
+		gpu.Le = Le;
+		gpu.La = La;
 	}
 };
 
 float rnd() { return (float)rand() / RAND_MAX; }
 
+struct RefHit {
+	float t;
+	vec3 position, normal;
+	int mat;	// material index
+	int object;	// index of the sphere
+};
+
+const int nSpheres = 500;	// the hierarchy has no limit on the number of spheres
+const int maxDepth = 5;		// of the reflection paths
+
 class Scene {
 	std::vector<Sphere *> objects;
 	std::vector<Light *> lights;
-	Camera camera;
+	Camera camera, previousCamera;
 	std::vector<Material *> materials;
+	unsigned int sceneBuffer = 0;	// shader storage buffer of lights, materials and spheres
+	unsigned int bvhBuffer = 0, bvhTexture = 0;	// texture buffer of the flattened hierarchy
+	std::vector<GPUNode> nodes;
+	std::vector<char> sceneData;	// CPU copy of the shader storage buffer, used by the reference renderer
+	bool dirty = true;				// scene data changed since the last upload
+
+	// build the subtree of spheres [begin, end) in depth first order, median split along the longest axis
+	void BuildBVH(std::vector<int>& spheres, int begin, int end) {
+		int n = nodes.size();
+		nodes.push_back(GPUNode());
+		vec3 bmin(1e30f, 1e30f, 1e30f), bmax(-1e30f, -1e30f, -1e30f);
+		vec3 cmin = bmin, cmax = bmax;		// bounds of the centers
+		for (int i = begin; i < end; i++) {
+			Sphere * s = objects[spheres[i]];
+			bmin = vec3(fminf(bmin.x, s->center.x - s->radius), fminf(bmin.y, s->center.y - s->radius), fminf(bmin.z, s->center.z - s->radius));
+			bmax = vec3(fmaxf(bmax.x, s->center.x + s->radius), fmaxf(bmax.y, s->center.y + s->radius), fmaxf(bmax.z, s->center.z + s->radius));
+			cmin = vec3(fminf(cmin.x, s->center.x), fminf(cmin.y, s->center.y), fminf(cmin.z, s->center.z));
+			cmax = vec3(fmaxf(cmax.x, s->center.x), fmaxf(cmax.y, s->center.y), fmaxf(cmax.z, s->center.z));
+		}
+		nodes[n].bmin = bmin;
+		nodes[n].bmax = bmax;
+		nodes[n].sphere = -1;
+		if (end - begin == 1) nodes[n].sphere = (float)spheres[begin];
+		else {
+			vec3 extent = cmax - cmin;
+			int axis = (extent.x > extent.y && extent.x > extent.z) ? 0 : (extent.y > extent.z) ? 1 : 2;
+			int mid = (begin + end) / 2;
+			std::nth_element(spheres.begin() + begin, spheres.begin() + mid, spheres.begin() + end, [&](int a, int b) {
+				return (&objects[a]->center.x)[axis] < (&objects[b]->center.x)[axis];
+			});
+			BuildBVH(spheres, begin, mid);
+			BuildBVH(spheres, mid, end);
+		}
+		nodes[n].skip = (float)nodes.size();
+	}
 public:
 	void build() {
 		vec3 eye = vec3(0, 0, 2);
@@ -279,23 +507,189 @@ public:
 		lights.push_back(new Light(vec3(1, 1, 1), vec3(3, 3, 3), vec3(0.4, 0.3, 0.3)));
 
 		vec3 kd(0.3f, 0.2f, 0.1f), ks(10, 10, 10);
-		for (int i = 0; i < 500; i++) objects.push_back(new Sphere(vec3(rnd() - 0.5, rnd() - 0.5, rnd() - 0.5), rnd() * 0.1));
+		for (int i = 0; i < nSpheres; i++) objects.push_back(new Sphere(vec3(rnd() - 0.5, rnd() - 0.5, rnd() - 0.5), rnd() * 0.1));
 
 		materials.push_back(new RoughMaterial(kd, ks, 50));
 		materials.push_back(new SmoothMaterial(vec3(0.9, 0.85, 0.8)));
 	}
+	// must be called when objects, lights or materials are modified
+	void Invalidate() { dirty = true; }
+	bool isDirty() { return dirty; }
+	// the first half of the spheres is of material 0, the rest of material 1
+	int nMaterial0Objects() { return objects.size() / 2; }
+	// the configuration the fragment shader is specialized for
+	std::string VariantDefines() {
+		GPUMaterial mats[nMaterials] = {};
+		for (int mat = 0; mat < materials.size() && mat < nMaterials; mat++) materials[mat]->Pack(mats[mat]);
+		int nMaterial0 = nMaterial0Objects();
+		bool usesMaterial[2] = { nMaterial0 > 0, objects.size() - nMaterial0 > 0 };
+		bool hasRough = (usesMaterial[0] && mats[0].rough) || (usesMaterial[1] && mats[1].rough);
+		bool hasReflective = (usesMaterial[0] && mats[0].reflective) || (usesMaterial[1] && mats[1].reflective);
+		char defines[1024];
+		sprintf(defines,
+			"#define N_OBJECTS %d\n#define N_MATERIAL0_OBJECTS %d\n#define MAX_DEPTH %d\n"
+			"#define ROUGH_MATERIALS bool[2](%s, %s)\n#define REFLECTIVE_MATERIALS bool[2](%s, %s)\n"
+			"#define HAS_ROUGH %d\n#define HAS_REFLECTIVE %d\n",
+			(int)objects.size(), nMaterial0, hasReflective ? maxDepth : 1,
+			mats[0].rough ? "true" : "false", mats[1].rough ? "true" : "false",
+			mats[0].reflective ? "true" : "false", mats[1].reflective ? "true" : "false",
+			hasRough ? 1 : 0, hasReflective ? 1 : 0);
+		return defines;
+	}
+	// pack the static scene into the std430 buffer, build the hierarchy and send them to the GPU
+	void Upload(unsigned int shaderProg) {
+		TRACE_SCOPE("Scene::Upload");
+		std::vector<char>& data = sceneData;
+		data.assign(sizeof(GPUSceneHeader) + objects.size() * sizeof(GPUSphere), 0);
+		GPUSceneHeader * header = (GPUSceneHeader *)&data[0];
+		lights[0]->Pack(header->light);
+		for (int mat = 0; mat < materials.size() && mat < nMaterials; mat++) materials[mat]->Pack(header->materials[mat]);
+		header->nObjects = objects.size();
+		GPUSphere * spheres = (GPUSphere *)(header + 1);
+		for (int o = 0; o < objects.size(); o++) objects[o]->Pack(spheres[o]);
+
+		if (sceneBuffer == 0) glGenBuffers(1, &sceneBuffer);
+		bindBuffer(GL_SHADER_STORAGE_BUFFER, sceneBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, data.size(), &data[0], GL_STATIC_DRAW);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 0, sceneBuffer);
+
+		nodes.clear();
+		std::vector<int> order(objects.size());
+		for (int o = 0; o < objects.size(); o++) order[o] = o;
+		if (!objects.empty()) BuildBVH(order, 0, objects.size());
+		if (bvhBuffer == 0) {
+			glGenBuffers(1, &bvhBuffer);
+			glGenTextures(1, &bvhTexture);
+		}
+		bindBuffer(GL_TEXTURE_BUFFER, bvhBuffer);
+		glBufferData(GL_TEXTURE_BUFFER, nodes.size() * sizeof(GPUNode), nodes.empty() ? NULL : &nodes[0], GL_STATIC_DRAW);
+		activeTexture(GL_TEXTURE0);
+		bindTexture(GL_TEXTURE_BUFFER, bvhTexture);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, bvhBuffer);
+		int location = getUniformLocation(shaderProg, "bvh");
+		if (location >= 0) glUniform1i(location, 0); else printf("uniform bvh cannot be set\n");
+		dirty = false;
+	}
+	// only the camera is set every frame, the rest of the scene is uploaded when dirty
 	void SetUniform(unsigned int shaderProg) {
-		int location = glGetUniformLocation(shaderProg, "nObjects");
-		if (location >= 0) glUniform1i(location, objects.size()); else printf("uniform nObjects cannot be set\n");
-		for (int o = 0; o < objects.size(); o++) objects[o]->SetUniform(shaderProg, o);
-		lights[0]->SetUniform(shaderProg);
+		if (dirty) Upload(shaderProg);
 		camera.SetUniform(shaderProg);
-		for (int mat = 0; mat < materials.size(); mat++) materials[mat]->SetUniform(shaderProg, mat);
+		previousCamera.SetUniform(shaderProg, true);
 	}
 	void Animate(float dt) { camera.Animate(dt); }
+	void EndFrame() { previousCamera = camera; }
+
+	// CPU reference of the fragment shader: same packed scene data, same float arithmetic,
+	// but brute force intersection instead of the hierarchy, so it also checks the traversal
+	RefHit intersectRef(const GPUSphere& object, const vec3& start, const vec3& dir) {
+		RefHit hit;
+		hit.t = -1;
+		vec3 dist = start - object.center;
+		float a = dot(dir, dir);
+		float b = dot(dist, dir) * 2.0f;
+		float c = dot(dist, dist) - object.radius * object.radius;
+		float discr = b * b - 4.0f * a * c;
+		if (discr < 0) return hit;
+		float sqrt_discr = sqrtf(discr);
+		float t1 = (-b + sqrt_discr) / 2.0f / a;	// t1 >= t2 for sure
+		float t2 = (-b - sqrt_discr) / 2.0f / a;
+		if (t1 <= 0) return hit;
+		hit.t = (t2 > 0) ? t2 : t1;
+		hit.position = start + dir * hit.t;
+		hit.normal = (hit.position - object.center) * (1.0f / object.radius);
+		return hit;
+	}
+	RefHit firstIntersectRef(const vec3& start, const vec3& dir) {
+		GPUSceneHeader * header = (GPUSceneHeader *)&sceneData[0];
+		GPUSphere * spheres = (GPUSphere *)(header + 1);
+		RefHit bestHit;
+		bestHit.t = -1;
+		int nMaterial0 = nMaterial0Objects();
+		for (int o = 0; o < header->nObjects; o++) {
+			RefHit hit = intersectRef(spheres[o], start, dir);
+			hit.mat = (o < nMaterial0) ? 0 : 1;
+			hit.object = o;
+			if (hit.t > 0 && (bestHit.t < 0 || hit.t < bestHit.t)) bestHit = hit;
+		}
+		if (dot(dir, bestHit.normal) > 0) bestHit.normal = -bestHit.normal;
+		return bestHit;
+	}
+	bool shadowIntersectRef(const vec3& start, const vec3& dir) {
+		GPUSceneHeader * header = (GPUSceneHeader *)&sceneData[0];
+		GPUSphere * spheres = (GPUSphere *)(header + 1);
+		for (int o = 0; o < header->nObjects; o++) if (intersectRef(spheres[o], start, dir).t > 0) return true;
+		return false;
+	}
+	// path: hash of the spheres hit and of the shadow tests, it changes where the ray crosses an edge of the scene
+	vec3 traceRef(vec3 start, vec3 dir, unsigned int& path) {
+		const float epsilon = 0.0001f;
+		const int maxdepth = maxDepth;
+		GPUSceneHeader * header = (GPUSceneHeader *)&sceneData[0];
+		GPULight& light = header->light;
+		vec3 weight(1, 1, 1), outRadiance(0, 0, 0);
+		for (int d = 0; d < maxdepth; d++) {
+			RefHit hit = firstIntersectRef(start, dir);
+			path = path * 1000003u + (hit.t < 0 ? 0 : hit.object + 1);
+			if (hit.t < 0) return weight * light.La;
+			GPUMaterial& mat = header->materials[hit.mat];
+			if (mat.rough == 1) {
+				outRadiance = outRadiance + weight * mat.ka * light.La;
+				float cosTheta = dot(hit.normal, light.direction);
+				bool lit = cosTheta > 0 && !shadowIntersectRef(hit.position + hit.normal * epsilon, light.direction);
+				path = path * 2 + (lit ? 1 : 0);
+				if (lit) {
+					outRadiance = outRadiance + weight * light.Le * mat.kd * cosTheta;
+					vec3 halfway = normalize(-dir + light.direction);
+					float cosDelta = dot(hit.normal, halfway);
+					if (cosDelta > 0) outRadiance = outRadiance + weight * light.Le * mat.ks * powf(cosDelta, mat.shininess);
+				}
+			}
+			if (mat.reflective == 1) {
+				float cosTheta = dot(-dir, hit.normal);
+				weight = weight * (mat.F0 + (vec3(1, 1, 1) - mat.F0) * powf(cosTheta, 5));	// Fresnel
+				start = hit.position + hit.normal * epsilon;
+				dir = dir - hit.normal * dot(hit.normal, dir) * 2.0f;						// reflect
+			} else return outRadiance;
+		}
+		return outRadiance;
+	}
+	// render the current frame on the CPU, rows bottom up like glReadPixels, with the path hash of every pixel
+	void RenderReference(std::vector<vec4>& image, std::vector<unsigned int>& paths) {
+		TRACE_SCOPE("Scene::RenderReference");
+		image.resize(windowWidth * windowHeight);
+		paths.assign(windowWidth * windowHeight, 0);
+		vec3 eye = camera.getEye();
+#pragma omp parallel for schedule(dynamic)
+		for (int Y = 0; Y < windowHeight; Y++) {
+			TRACE_SCOPE("reference row");
+			for (int X = 0; X < windowWidth; X++) {
+				vec3 p = camera.windowPoint((X + 0.5f) / windowWidth * 2 - 1, (Y + 0.5f) / windowHeight * 2 - 1);
+				vec3 color = traceRef(eye, normalize(p - eye), paths[Y * windowWidth + X]);
+				image[Y * windowWidth + X] = vec4(color.x, color.y, color.z, 1);
+			}
+		}
+	}
 };
 
-GPUProgram gpuProgram; // vertex and fragment shaders
+// Compiled fragment shader variants, keyed by their #define block
+class ShaderVariants {
+	std::map<std::string, GPUProgram *> programs;
+public:
+	GPUProgram * Get(const std::string& defines) {
+		auto variant = programs.find(defines);
+		if (variant != programs.end()) return variant->second;
+		std::string source = "#version 450\n" + defines + fragmentSource;
+		GPUProgram * program = new GPUProgram();
+		program->Create(vertexSource, source.c_str(), "fragmentColor");
+		printf("compiled shader variant %d:\n%s", (int)programs.size(), defines.c_str());
+		programs[defines] = program;
+		return program;
+	}
+};
+
+ShaderVariants shaderVariants;
+GPUProgram * gpuProgram; // vertex and fragment shaders of the current scene configuration
+GPUProgram upsampleProgram;
 Scene scene;
 
 class FullScreenTexturedQuad {
@@ -303,13 +697,13 @@ class FullScreenTexturedQuad {
 public:
 	void Create() {
 		glGenVertexArrays(1, &vao);	// create 1 vertex array object
-		glBindVertexArray(vao);		// make it active
+		bindVertexArray(vao);		// make it active
 
 		unsigned int vbo;		// vertex buffer objects
 		glGenBuffers(1, &vbo);	// Generate 1 vertex buffer objects
 
 		// vertex coordinates: vbo0 -> Attrib Array 0 -> vertexPosition of the vertex shader
-		glBindBuffer(GL_ARRAY_BUFFER, vbo); // make it active, it is an array
+		bindBuffer(GL_ARRAY_BUFFER, vbo); // make it active, it is an array
 		float vertexCoords[] = { -1, -1,  1, -1,  1, 1,  -1, 1 };	// two triangles forming a quad
 		glBufferData(GL_ARRAY_BUFFER, sizeof(vertexCoords), vertexCoords, GL_STATIC_DRAW);	   // copy to that part of the memory which is not modified 
 		glEnableVertexAttribArray(0);
@@ -317,41 +711,264 @@ public:
 	}
 
 	void Draw() {
-		glBindVertexArray(vao);	// make the vao and its vbos active playing the role of the data source
-		glDrawArrays(GL_TRIANGLE_FAN, 0, 4);	// draw two triangles forming a quad
+		bindVertexArray(vao);	// make the vao and its vbos active playing the role of the data source
+		drawArrays(GL_TRIANGLE_FAN, 0, 4);	// draw two triangles forming a quad
 	}
 };
 
 FullScreenTexturedQuad fullScreenTexturedQuad;
 
+// Frame time controller of the rendering resolution, 'd' turns it on. It follows GLUT_ELAPSED_TIME, so with the
+// fixed timestep of the headless backend it sees the same frame times on every machine.
+class ResolutionController {
+	float smoothedFrameTime = 0;
+	long lastFrame = 0;
+	bool started = false;
+	long lastLog = 0;
+public:
+	bool enabled = false;
+	float targetFrameTime = 50;		// msec, '+' and '-' change it
+	float scale = 1;				// of the window width and height
+	const float minScale = 0.25f;
+
+	int width() { return (int)(windowWidth * scale + 0.5f); }
+	int height() { return (int)(windowHeight * scale + 0.5f); }
+	// the cost is proportional to the number of pixels, so the scale follows the square root of the time ratio
+	void Update() {
+		long now = glutGet(GLUT_ELAPSED_TIME);
+		if (!started) {
+			lastFrame = now;
+			started = true;
+			return;
+		}
+		float frameTime = (float)fmax(now - lastFrame, 1);
+		lastFrame = now;
+		smoothedFrameTime = (smoothedFrameTime == 0) ? frameTime : 0.8f * smoothedFrameTime + 0.2f * frameTime;
+		if (enabled) {
+			float change = fminf(fmaxf(sqrtf(targetFrameTime / smoothedFrameTime), 0.9f), 1.1f);	// damped
+			scale = fminf(fmaxf(scale * change, minScale), 1);
+		} else scale = 1;
+		if (enabled && now - lastLog >= 1000) {
+			printf("\nresolution scale %.2f (%dx%d), frame time %.1f msec, target %.1f msec\n", scale, width(), height(), smoothedFrameTime, targetFrameTime);
+			lastLog = now;
+		}
+	}
+};
+
+ResolutionController resolution;
+
+// Ping-pong float render targets of temporal reprojection, alpha holds the depth of the pixel.
+// Frames are rendered into the lower left corner at the resolution chosen by the controller.
+class HistoryBuffers {
+	unsigned int fbo[2], texture[2];
+	int current = 0;
+	int frame = 0;
+	int width[2] = { windowWidth, windowWidth }, height[2] = { windowHeight, windowHeight };	// rendered part
+public:
+	bool enabled = true;
+	bool valid = false;		// the previous target holds a frame of the same scene
+	void Create() {
+		glGenFramebuffers(2, fbo);
+		glGenTextures(2, texture);
+		for (int i = 0; i < 2; i++) {
+			bindTexture(GL_TEXTURE_2D, texture[i]);
+			glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA32F, windowWidth, windowHeight, 0, GL_RGBA, GL_FLOAT, NULL);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+			bindFramebuffer(GL_FRAMEBUFFER, fbo[i]);
+			glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, texture[i], 0);
+			if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE) printf("history framebuffer is incomplete\n");
+		}
+		bindFramebuffer(GL_FRAMEBUFFER, 0);
+	}
+	// render into the current target with the previous one as history
+	void Begin(unsigned int shaderProg, int renderWidth, int renderHeight) {
+		bindFramebuffer(GL_FRAMEBUFFER, fbo[current]);
+		width[current] = renderWidth;
+		height[current] = renderHeight;
+		glViewport(0, 0, renderWidth, renderHeight);
+		activeTexture(GL_TEXTURE1);		// unit 0 is the bvh
+		bindTexture(GL_TEXTURE_2D, texture[1 - current]);
+		int location = getUniformLocation(shaderProg, "history");
+		if (location >= 0) glUniform1i(location, 1); else printf("uniform history cannot be set\n");
+		location = getUniformLocation(shaderProg, "temporal");
+		if (location >= 0) glUniform1i(location, (enabled && valid) ? 1 : 0); else printf("uniform temporal cannot be set\n");
+		location = getUniformLocation(shaderProg, "frameParity");
+		if (location >= 0) glUniform1i(location, frame % 2); else printf("uniform frameParity cannot be set\n");
+		location = getUniformLocation(shaderProg, "historySize");
+		if (location >= 0) glUniform2i(location, width[1 - current], height[1 - current]); else printf("uniform historySize cannot be set\n");
+	}
+	// upsample the frame to the window and swap the targets
+	void End() {
+		TRACE_SCOPE("HistoryBuffers::End");
+		bindFramebuffer(GL_FRAMEBUFFER, 0);
+		glViewport(0, 0, windowWidth, windowHeight);
+		upsampleProgram.Use();
+		activeTexture(GL_TEXTURE1);
+		bindTexture(GL_TEXTURE_2D, texture[current]);
+		int location = getUniformLocation(upsampleProgram.getId(), "frame");
+		if (location >= 0) glUniform1i(location, 1); else printf("uniform frame cannot be set\n");
+		location = getUniformLocation(upsampleProgram.getId(), "renderSize");
+		if (location >= 0) glUniform2i(location, width[current], height[current]); else printf("uniform renderSize cannot be set\n");
+		fullScreenTexturedQuad.Draw();
+		current = 1 - current;
+		frame++;
+		valid = true;
+	}
+};
+
+HistoryBuffers historyBuffers;
+
+void SaveTGAFile(const char * fileName, const std::vector<vec4>& image) {
+	FILE * tgaFile = fopen(fileName, "wb");
+	if (!tgaFile) {
+		printf("File %s cannot be opened\n", fileName);
+		return;
+	}
+	// File header
+	fputc(0, tgaFile); fputc(0, tgaFile); fputc(2, tgaFile);
+	for (int i = 3; i < 12; i++) { fputc(0, tgaFile); }
+	fputc(windowWidth % 256, tgaFile); fputc(windowWidth / 256, tgaFile);
+	fputc(windowHeight % 256, tgaFile); fputc(windowHeight / 256, tgaFile);
+	fputc(24, tgaFile); fputc(32, tgaFile);
+	// List of pixel colors
+	for (int Y = windowHeight - 1; Y >= 0; Y--) {
+		for (int X = 0; X < windowWidth; X++) {
+			const vec4& c = image[Y * windowWidth + X];
+			int R = (int)fmaxf(fminf(c.x * 255.5f, 255.5f), 0);
+			int G = (int)fmaxf(fminf(c.y * 255.5f, 255.5f), 0);
+			int B = (int)fmaxf(fminf(c.z * 255.5f, 255.5f), 0);
+			fputc(B, tgaFile); fputc(G, tgaFile); fputc(R, tgaFile);
+		}
+	}
+	fclose(tgaFile);
+}
+
+bool compareRequested = false;	// 'r': the next frame is traced fully at window resolution and compared
+bool referenceTest = false;		// "-reference": compare the first frame and exit with 1 if it does not match
+
+const float maxPixelDiff = 2.0f / 255;	// float rounding compounds over the reflections
+const int maxInteriorDifferent = 16;	// pixels off the edges that may differ by more than maxPixelDiff
+
+float pixelDiff(const vec4& cpu, const vec4& gpu) {
+	float diff = 0;
+	for (int c = 0; c < 3; c++) diff = fmaxf(diff, fabsf(fminf(fmaxf((&cpu.x)[c], 0), 1) - (&gpu.x)[c]));
+	return diff;
+}
+
+// true if a neighbour of the pixel follows another path in the reference: float rounding may move the edge by a pixel
+bool onEdge(const std::vector<unsigned int>& paths, int X, int Y) {
+	for (int y = std::max(Y - 1, 0); y <= std::min(Y + 1, (int)windowHeight - 1); y++) {
+		for (int x = std::max(X - 1, 0); x <= std::min(X + 1, (int)windowWidth - 1); x++)
+			if (paths[y * windowWidth + x] != paths[Y * windowWidth + X]) return true;
+	}
+	return false;
+}
+
+// Render the current frame with the CPU reference and diff it against the frame in the back buffer. Pixels on the
+// silhouettes and shadow edges of the reference paths are counted apart, the test passes if at most maxInteriorDifferent
+// other pixels differ by more than maxPixelDiff: a sphere missed by the traversal fails it unless it is so small or far
+// down a chain of reflections that all of its pixels are on edges.
+bool CompareWithReference() {
+	std::vector<vec4> gpuImage(windowWidth * windowHeight), cpuImage;
+	std::vector<unsigned int> paths;
+	glReadPixels(0, 0, windowWidth, windowHeight, GL_RGBA, GL_FLOAT, &gpuImage[0]);
+
+	auto start = std::chrono::high_resolution_clock::now();
+	scene.RenderReference(cpuImage, paths);
+	double msec = std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+
+	float maxDiff = 0, sumDiff = 0;
+	int nDifferent = 0, nEdgeDifferent = 0;
+	for (int Y = 0; Y < windowHeight; Y++) {
+		for (int X = 0; X < windowWidth; X++) {
+			int i = Y * windowWidth + X;
+			float diff = pixelDiff(cpuImage[i], gpuImage[i]);
+			maxDiff = fmaxf(maxDiff, diff);
+			sumDiff += diff;
+			if (diff <= maxPixelDiff) continue;
+			if (onEdge(paths, X, Y)) nEdgeDifferent++; else nDifferent++;
+		}
+	}
+	printf("\nreference: %.1f msec (%.2f frames/sec), max diff %.1f/255, mean diff %.3f/255\n",
+		msec, 1000 / msec, maxDiff * 255, sumDiff / (windowWidth * windowHeight) * 255);
+	printf("pixels differing by more than 2/255: %d inside (at most %d allowed), %d on edges\n", nDifferent, maxInteriorDifferent, nEdgeDifferent);
+	SaveTGAFile("gpu.tga", gpuImage);
+	SaveTGAFile("reference.tga", cpuImage);
+	return nDifferent <= maxInteriorDifferent;
+}
+
 // Initialization, create an OpenGL context
 void onInitialization() {
 	glViewport(0, 0, windowWidth, windowHeight);
 	scene.build();
 	fullScreenTexturedQuad.Create();
+	historyBuffers.Create();
 
 	// create program for the GPU
-	gpuProgram.Create(vertexSource, fragmentSource, "fragmentColor");
-	gpuProgram.Use();
+	upsampleProgram.Create(upsampleVertexSource, upsampleFragmentSource, "fragmentColor");
+	gpuProgram = shaderVariants.Get(scene.VariantDefines());
+	gpuProgram->Use();
+
+	referenceTest = compareRequested = hasCommandLineOption("-reference");
 }
 
 // Window has become invalid: Redraw
 void onDisplay() {
 	static int nFrames = 0;
+	static double cpuTotal = 0;		// usec spent on the CPU side of the frame
 	nFrames++;
 	static long tStart = glutGet(GLUT_ELAPSED_TIME);
 	long tEnd = glutGet(GLUT_ELAPSED_TIME);
-	printf("%d msec\r", (tEnd - tStart) / nFrames);
+	auto cpuStart = std::chrono::high_resolution_clock::now();
 
+	resolution.Update();
+	if (scene.isDirty()) {
+		historyBuffers.valid = false;
+		gpuProgram = shaderVariants.Get(scene.VariantDefines());
+	}
+	gpuProgram->Use();
+	if (compareRequested) {		// neither reused nor upsampled pixels in the compared frame
+		historyBuffers.valid = false;
+		historyBuffers.Begin(gpuProgram->getId(), windowWidth, windowHeight);
+	}
+	else historyBuffers.Begin(gpuProgram->getId(), resolution.width(), resolution.height());
 	glClearColor(1.0f, 0.5f, 0.8f, 1.0f);							// background color 
 	glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT); // clear the screen
-	scene.SetUniform(gpuProgram.getId());
-	fullScreenTexturedQuad.Draw();
+	scene.SetUniform(gpuProgram->getId());
+	{
+		TRACE_SCOPE("ray tracing pass");
+		fullScreenTexturedQuad.Draw();
+	}
+	historyBuffers.End();
+	scene.EndFrame();
+
+	cpuTotal += std::chrono::duration<double, std::micro>(std::chrono::high_resolution_clock::now() - cpuStart).count();
+	printf("%ld msec/frame, cpu %.1f usec/frame, scale %.2f\r", (tEnd - tStart) / nFrames, cpuTotal / nFrames, resolution.scale);
+	if (compareRequested) {
+		bool match = CompareWithReference();
+		compareRequested = false;
+		if (referenceTest) {
+			printf("reference test %s\n", match ? "passed" : "failed");
+			exit(match ? 0 : 1);
+		}
+	}
 	glutSwapBuffers();									// exchange the two buffers
 }
 
 // Key of ASCII code pressed
 void onKeyboard(unsigned char key, int pX, int pY) {
+	if (key == 'r') compareRequested = true;	// diff the next frame against the CPU reference
+	if (key == 'd') {							// dynamic resolution on/off
+		resolution.enabled = !resolution.enabled;
+		printf("\ndynamic resolution %s\n", resolution.enabled ? "on" : "off");
+	}
+	if (key == '+') resolution.targetFrameTime *= 1.25f;
+	if (key == '-') resolution.targetFrameTime /= 1.25f;
+	if (key == 't') {							// temporal reprojection on/off
+		historyBuffers.enabled = !historyBuffers.enabled;
+		printf("\ntemporal reprojection %s\n", historyBuffers.enabled ? "on" : "off");
+	}
 }
 
 // Key of ASCII code released
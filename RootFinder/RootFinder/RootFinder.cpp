@@ -123,11 +123,11 @@ public:
 	}
 	void Create() {
 		glGenVertexArrays(1, &vao);	// create 1 vertex array object
-		glBindVertexArray(vao);		// make it active
+		bindVertexArray(vao);		// make it active
 
 		glGenBuffers(1, &vbo);	// Generate 1 vertex buffer objects
 		// vertex coordinates: vbo[0] -> Attrib Array 0 -> vertexPosition of the vertex shader
-		glBindBuffer(GL_ARRAY_BUFFER, vbo); // make it active, it is an array
+		bindBuffer(GL_ARRAY_BUFFER, vbo); // make it active, it is an array
 		glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);	   // copy to that part of the memory which is not modified 
 		// Map Attribute Array 0 to the current bound vertex buffer (vbo[0])
 		glEnableVertexAttribArray(0);
@@ -135,15 +135,15 @@ public:
 	}
 
 	void Draw() {
-		int location = glGetUniformLocation(gpgpuShader->getId(), "dx");
+		int location = getUniformLocation(gpgpuShader->getId(), "dx");
 		if (location >= 0) glUniform1f(location, camera.dX());
-		location = glGetUniformLocation(gpgpuShader->getId(), "dy");
+		location = getUniformLocation(gpgpuShader->getId(), "dy");
 		if (location >= 0) glUniform1f(location, camera.dY());
 		mat4 VPinvTransform = camera.Pinv() * camera.Vinv();
 		VPinvTransform.SetUniform(gpgpuShader->getId(), "VPinv");
 
-		glBindVertexArray(vao);	// make the vao and its vbos active playing the role of the data source
-		glDrawArrays(GL_TRIANGLE_FAN, 0, 4);	// draw two triangles forming a quad
+		bindVertexArray(vao);	// make the vao and its vbos active playing the role of the data source
+		drawArrays(GL_TRIANGLE_FAN, 0, 4);	// draw two triangles forming a quad
 	}
 };
 
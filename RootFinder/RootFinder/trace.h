@@ -0,0 +1,100 @@
+//=============================================================================================
+// Event tracing of the framework and of the programs without it: TRACE_SCOPE("name") blocks are recorded into
+// per-thread ring buffers and written as Chrome trace JSON (chrome://tracing, ui.perfetto.dev). Names must be string
+// literals. Header only, so that a program without the framework needs no other file.
+//=============================================================================================
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+#include <mutex>
+#include <chrono>
+
+struct TraceEvent { const char * name; double start, duration; };	// usec
+
+struct TraceBuffer {	// ring of the last events of a thread
+	static const size_t capacity = 1 << 16;
+	std::vector<TraceEvent> events;
+	size_t nRecorded = 0;
+	int threadId;
+};
+
+struct TraceLog {
+	const char * fileName = NULL;
+	const char * processName = NULL;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::mutex mutex;					// guards the list, each buffer is written by its thread only
+	std::vector<TraceBuffer *> buffers;
+};
+
+// Never destroyed: scopes of other threads and of static destructors may end after exit
+inline TraceLog& traceLog() { static TraceLog * log = new TraceLog(); return *log; }
+// Constant initialized, so testing it is a single load
+inline bool& traceEnabled() { static bool enabled = false; return enabled; }
+
+inline double traceClock() {	// usec
+	return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - traceLog().start).count();
+}
+
+inline void traceRecord(const char * name, double start) {	// complete event from start to now
+	static thread_local TraceBuffer * buffer = NULL;
+	double end = traceClock();
+	if (!buffer) {
+		buffer = new TraceBuffer();
+		buffer->events.resize(TraceBuffer::capacity);
+		TraceLog& log = traceLog();
+		std::lock_guard<std::mutex> lock(log.mutex);
+		buffer->threadId = (int)log.buffers.size();
+		log.buffers.push_back(buffer);
+	}
+	TraceEvent& event = buffer->events[buffer->nRecorded++ % TraceBuffer::capacity];
+	event.name = name;
+	event.start = start;
+	event.duration = end - start;
+}
+
+inline void saveTrace() {
+	if (!traceEnabled()) return;
+	TraceLog& log = traceLog();
+	FILE * file = fopen(log.fileName, "w");
+	if (!file) { printf("cannot write %s\n", log.fileName); return; }
+	std::lock_guard<std::mutex> lock(log.mutex);
+	fprintf(file, "{\"traceEvents\":[\n");
+	fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"%s\"}}", log.processName);
+	size_t nEvents = 0;
+	for (TraceBuffer * buffer : log.buffers) {
+		size_t first = (buffer->nRecorded > TraceBuffer::capacity) ? buffer->nRecorded - TraceBuffer::capacity : 0;
+		for (size_t i = first; i < buffer->nRecorded; i++) {
+			const TraceEvent& event = buffer->events[i % TraceBuffer::capacity];
+			fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+				event.name, buffer->threadId, event.start, event.duration);
+			nEvents++;
+		}
+	}
+	fprintf(file, "\n]}\n");
+	fclose(file);
+	printf("%d trace events written to %s\n", (int)nEvents, log.fileName);
+}
+
+// Record from now on and write fileName at exit; the time stamps count from this call
+inline void startTrace(const char * fileName, const char * processName) {
+	TraceLog& log = traceLog();
+	log.fileName = fileName;
+	log.processName = processName;
+	log.start = std::chrono::steady_clock::now();
+	traceEnabled() = true;
+	atexit(saveTrace);
+}
+
+struct TraceScope {
+	const char * name;
+	double start;
+	TraceScope(const char * _name) {		// a single flag test when tracing is off
+		name = traceEnabled() ? _name : NULL;
+		start = name ? traceClock() : 0;
+	}
+	~TraceScope() { if (name) traceRecord(name, start); }
+};
+#define TRACE_CONCAT(a, b) a##b
+#define TRACE_SCOPE_AT(name, line) TraceScope TRACE_CONCAT(traceScope, line)(name)
+#define TRACE_SCOPE(name) TRACE_SCOPE_AT(name, __LINE__)
@@ -95,18 +95,18 @@ public:
 	}
 	void Create() {
 		glGenVertexArrays(1, &vao);	// create 1 vertex array object
-		glBindVertexArray(vao);		// make it active
+		bindVertexArray(vao);		// make it active
 
 		glGenBuffers(2, vbo);	// Generate 1 vertex buffer objects
 
 		// vertex coordinates: vbo[0] -> Attrib Array 0 -> vertexPosition of the vertex shader
-		glBindBuffer(GL_ARRAY_BUFFER, vbo[0]); // make it active, it is an array
+		bindBuffer(GL_ARRAY_BUFFER, vbo[0]); // make it active, it is an array
 		glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_DYNAMIC_DRAW);	   // copy to that part of the memory which will be modified 
 		// Map Attribute Array 0 to the current bound vertex buffer (vbo[0])
 		glEnableVertexAttribArray(0);
 		glVertexAttribPointer(0, 2, GL_FLOAT, GL_FALSE, 0, NULL);     // stride and offset: it is tightly packed
 
-		glBindBuffer(GL_ARRAY_BUFFER, vbo[1]); // make it active, it is an array
+		bindBuffer(GL_ARRAY_BUFFER, vbo[1]); // make it active, it is an array
 		glBufferData(GL_ARRAY_BUFFER, sizeof(uvs), uvs, GL_STATIC_DRAW);	   // copy to that part of the memory which is not modified 
 		// Map Attribute Array 0 to the current bound vertex buffer (vbo[0])
 		glEnableVertexAttribArray(1);
@@ -121,11 +121,11 @@ public:
 			}
 		}
 
-		pTexture = new Texture(width, height, image);
+		pTexture = new Texture(width, height, image, GL_R8, true);	// grey levels, minified by the deformed quad
 	}
 
 	void MoveVertex(float cX, float cY) {
-		glBindBuffer(GL_ARRAY_BUFFER, vbo[0]);
+		bindBuffer(GL_ARRAY_BUFFER, vbo[0]);
 
 		vec4 wCursor4 = vec4(cX, cY, 0, 1) * camera.Pinv() * camera.Vinv();
 		vec2 wCursor(wCursor4.x, wCursor4.y);
@@ -146,20 +146,20 @@ public:
 	}
 
 	void Draw() {
-		glBindVertexArray(vao);	// make the vao and its vbos active playing the role of the data source
+		bindVertexArray(vao);	// make the vao and its vbos active playing the role of the data source
 
 		mat4 MVPTransform = camera.V() * camera.P();
 
 		// set GPU uniform matrix variable MVP with the content of CPU variable MVPTransform
 		MVPTransform.SetUniform(gpuProgram.getId(), "MVP");
 
-		int location = glGetUniformLocation(gpuProgram.getId(), "isGPUProcedural");
+		int location = getUniformLocation(gpuProgram.getId(), "isGPUProcedural");
 		if (location >= 0) glUniform1i(location, isGPUProcedural); // set uniform variable MVP to the MVPTransform
 		else printf("isGPUProcedural cannot be set\n");
 
 		pTexture->SetUniform(gpuProgram.getId(), "textureUnit");
 
-		glDrawArrays(GL_TRIANGLE_FAN, 0, 4);	// draw two triangles forming a quad
+		drawArrays(GL_TRIANGLE_FAN, 0, 4);	// draw two triangles forming a quad
 	}
 };
 